@@ -31,7 +31,13 @@ char version[] = VERSION;
 char* command;
 
 #include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,12 +45,22 @@ char* command;
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <linux/magic.h>
 #include <linux/version.h>
 #include <mntent.h>
+#include <poll.h>
 #include <pwd.h>
+#include <regex.h>
+#include <sched.h>
 #include <sys/errno.h>
 #include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
@@ -54,9 +70,14 @@ char* command;
 #ifndef NOREMOTE
 #include <net/if.h>
 #include <netinet/in.h>
-#include <sys/socket.h>
 #endif
 
+/* netlink reads the network counters, with or without remote output */
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <netdb.h>
@@ -72,19 +93,36 @@ char* command;
 int debug = 0;
 uid_t uid = (uid_t)123456;
 
-/* collect stats on the metrix */
+/* collect stats on the metrix
+ * the emitter state is per thread so the -j collector threads each write
+ * their own section buffer, see collector_task() */
 int precimon_stats = 0;
-int precimon_sections = 0;
-int precimon_subsections = 0;
-int precimon_string = 0;
-int precimon_long = 0;
-int precimon_double = 0;
-int precimon_hex = 0;
+__thread int precimon_sections = 0;
+__thread int precimon_subsections = 0;
+__thread int precimon_string = 0;
+__thread int precimon_long = 0;
+__thread int precimon_double = 0;
+__thread int precimon_hex = 0;
 
 /* Output JSON test buffering to ensure ist a single write and allow EOL comma removal */
-char* output;
-long output_size = 0;
-long output_char = 0;
+__thread char* output;
+__thread long output_size = 0;
+__thread long output_char = 0;
+long output_high_water = 0; /* most bytes a push() has written */
+long output_reallocs = 0; /* times the arena had to grow after the first snapshot */
+__thread int output_steady = 0; /* set once the first snapshot is out, section buffers never are */
+
+/* asynchronous writer (-w), see writer_push() */
+#define WRITER_OFF 0
+#define WRITER_DROP 1
+#define WRITER_BLOCK 2
+#define WRITER_SPILL 3
+char* writer_policies[] = { "off", "drop", "block", "spill" };
+int writer_policy = WRITER_OFF;
+long writer_slots = 8;
+long long writer_queued_bytes = 0;
+long long writer_dropped_bytes = 0; /* thrown away by the drop policy */
+long long writer_stalled_bytes = 0; /* waited for or spilled when the ring was full */
 char* nullstring = "";
 long level = 0;
 volatile sig_atomic_t interrupted = 0;
@@ -115,9 +153,24 @@ int sockfd = 1; /*default is stdout, only changed if we are using a remote socke
 *    the JSON is appended to the buffer "output" so
 *        we can remove the trailing "," before we close the entry with a "}"
 *        we can write the whole record in a single write (push()) to help down stream tools
+*
+*    with -B the same calls append CBOR (RFC 8949) instead of JSON text
+*       sections, subsections and array elements become indefinite length maps
+*       arrays become indefinite length arrays and the break byte closes both
+*       doubles are stored as binary floats so the agent does no float to text work
+*       phex values are unsigned integers tagged 23 (expected base16 conversion)
+*    precimon_decode turns the CBOR stream back into the JSON precimon would write
+*
+*    with -K each snapshot is written positionally (JSON or CBOR)
+*       "schema": ["{snapshot_info", "datetime", ... "}", "{cpus", "{cpu0", "user", ...]
+*       "values": ["2019-01-01T12:00:00", ... 1.250, ...]
+*       the schema lists the p function calls: "{name" psection/psub, "[name" parray,
+*       "{" parrayelement, "}" and "]" the ends, anything else is the name of a value
+*       the schema is only written when it differs from the previous snapshot
+*       i.e. CPUs, disks, networks or processes came or went
 */
-
-#ifndef NOREMOTE
+int cbor_mode = 0;
+int positional_mode = 0;
 
 void pexit(char* msg)
 {
@@ -125,6 +178,8 @@ void pexit(char* msg)
     exit(1);
 }
 
+#ifndef NOREMOTE
+
 int en[94] = {
     8, 85, 70, 53, 93, 72, 61, 1, 41, 36,
     49, 92, 44, 42, 25, 58, 81, 15, 57, 10,
@@ -229,55 +284,422 @@ void get_hostname()
 
 void remove_ending_comma_if_any()
 {
-    if (output[output_char - 2] == ',') {
+    if (output_char >= 2 && output[output_char - 2] == ',') {
         output[output_char - 2] = '\n';
         output_char--;
     }
 }
 
-void buffer_check()
+/* Every p function reserves the most bytes it can write (plus the string
+ * terminator) before writing. output_arena_size() sizes the arena so this
+ * only grows it if the host changed a lot since the first snapshot. */
+#define PLINE 32 /* indentation aside: quotes, ": ", ",\n" or the CBOR heads and tags */
+#define PNUMBER 24 /* 20 digits, a sign or the CBOR argument */
+#define PDOUBLE 330 /* "%.3f" of the largest double */
+
+void pneed(long len)
 {
     long size;
-    if (output_char > (long)(output_size * 0.95)) { /* within 5% of the end */
-        size = output_size + (1024 * 1024); /* add another MB */
+
+    if (output_char + len + 1 > output_size) {
+        size = (output_char + len + 1) * 2;
         output = realloc((void*)output, size);
         output_size = size;
+        if (output_steady)
+            output_reallocs++;
     }
 }
 
 void praw(char* string)
 {
-    output_char += sprintf(&output[output_char], "%s", string);
+    size_t len = strlen(string);
+
+    if (cbor_mode)
+        return; /* raw text has no place in a CBOR stream */
+    pneed(len);
+    memcpy(&output[output_char], string, len + 1);
+    output_char += len;
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   fast formatting used by the p functions
+*    The metrics are written many thousand times per snapshot on large hosts so
+*    the numbers are converted by hand rather than through the printf machinery.
+*    The output is byte for byte what the matching printf format produces:
+*       pdigits()    "%llu"
+*       pnumber()    "%lld"
+*       phexdigits() "%08llx"
+*       pfixed3()    "%.3f" (falls back to snprintf when rounding is too close to call)
+*/
+
+char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+#define TABS_MAX ((long)sizeof(tabs) - 1)
+
+void pchars(char* string, long len)
+{
+    memcpy(&output[output_char], string, len);
+    output_char += len;
+}
+
+/* writes "name": */
+void pname(char* name, long len)
+{
+    output[output_char++] = '"';
+    memcpy(&output[output_char], name, len);
+    output_char += len;
+    memcpy(&output[output_char], "\": ", 3);
+    output_char += 3;
+}
+
+/* writes ,<newline> after a value and keeps the buffer a string */
+void pendline()
+{
+    memcpy(&output[output_char], ",\n", 3);
+    output_char += 2;
+}
+
+void pdigits(long long unsigned value)
+{
+    char buf[24];
+    char* s = &buf[sizeof(buf)];
+
+    do {
+        *--s = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+    pchars(s, &buf[sizeof(buf)] - s);
+}
+
+void pnumber(long long value)
+{
+    if (value < 0) {
+        output[output_char++] = '-';
+        pdigits(-(long long unsigned)value);
+    } else
+        pdigits(value);
+}
+
+void phexdigits(long long unsigned value)
+{
+    char buf[24];
+    char* s = &buf[sizeof(buf)];
+    char* stop = &buf[sizeof(buf) - 8]; /* at least 8 digits */
+
+    do {
+        *--s = "0123456789abcdef"[value & 0xf];
+        value >>= 4;
+    } while (value != 0 || s > stop);
+    pchars(s, &buf[sizeof(buf)] - s);
+}
+
+void pfixed3(double value)
+{
+    double scaled;
+    double frac;
+    double window;
+    long long unsigned whole;
+    char buf[8];
+
+    /* NaN, infinities and anything that does not fit 53 bits once scaled */
+    if (!(value > -9.0e12 && value < 9.0e12)) {
+        output_char += snprintf(&output[output_char], PDOUBLE, "%.3f", value);
+        return;
+    }
+    scaled = (signbit(value) ? -value : value) * 1000.0;
+    whole = (long long unsigned)scaled;
+    frac = scaled - (double)whole;
+    /* the multiply above is out by up to half a ULP so a fraction near .5 could
+     * round either way, let printf work out the exact decimal expansion */
+    window = 1.0e-6 + scaled * 4.5e-16;
+    if (frac > 0.5 - window && frac < 0.5 + window) {
+        output_char += snprintf(&output[output_char], PDOUBLE, "%.3f", value);
+        return;
+    }
+    if (frac > 0.5)
+        whole++;
+
+    if (signbit(value))
+        output[output_char++] = '-';
+    pdigits(whole / 1000);
+    whole %= 1000;
+    buf[0] = '.';
+    buf[1] = '0' + whole / 100;
+    buf[2] = '0' + (whole / 10) % 10;
+    buf[3] = '0' + whole % 10;
+    pchars(buf, 4);
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   CBOR encoding used by the p functions when cbor_mode is set */
+
+#define CBOR_UNSIGNED 0
+#define CBOR_NEGATIVE 1
+#define CBOR_TEXT 3
+#define CBOR_TAG 6
+#define CBOR_MAP_START 0xbf /* indefinite length map */
+#define CBOR_ARRAY_START 0x9f /* indefinite length array */
+#define CBOR_BREAK 0xff
+#define CBOR_FLOAT32 0xfa
+#define CBOR_FLOAT64 0xfb
+#define CBOR_TAG_BASE16 23
+#define CBOR_SELF_DESCRIBE "\xd9\xd9\xf7" /* tag 55799 marks the stream as CBOR */
+
+void cbor_byte(int byte)
+{
+    output[output_char++] = (char)byte;
+}
+
+/* major type plus the shortest big endian argument that holds value */
+void cbor_head(int major, long long unsigned value)
+{
+    int bytes;
+
+    major <<= 5;
+    if (value < 24) {
+        cbor_byte(major | (int)value);
+        return;
+    }
+    if (value <= 0xff) {
+        cbor_byte(major | 24);
+        bytes = 1;
+    } else if (value <= 0xffff) {
+        cbor_byte(major | 25);
+        bytes = 2;
+    } else if (value <= 0xffffffffULL) {
+        cbor_byte(major | 26);
+        bytes = 4;
+    } else {
+        cbor_byte(major | 27);
+        bytes = 8;
+    }
+    while (bytes-- > 0)
+        cbor_byte((int)(value >> (bytes * 8)) & 0xff);
+}
+
+void cbor_text(char* string)
+{
+    size_t len = strlen(string);
+
+    cbor_head(CBOR_TEXT, len);
+    pchars(string, len);
+}
+
+void cbor_long(long long value)
+{
+    if (value < 0)
+        cbor_head(CBOR_NEGATIVE, (long long unsigned)(-1 - value));
+    else
+        cbor_head(CBOR_UNSIGNED, value);
+}
+
+/* single precision when it holds the value exactly, many rates are floats already */
+void cbor_double(double value)
+{
+    float single = (float)value;
+    union {
+        float f;
+        uint32_t u;
+    } f32;
+    union {
+        double d;
+        uint64_t u;
+    } f64;
+    int bytes;
+
+    if ((double)single == value) {
+        f32.f = single;
+        cbor_byte(CBOR_FLOAT32);
+        for (bytes = 4; bytes-- > 0;)
+            cbor_byte((int)(f32.u >> (bytes * 8)) & 0xff);
+    } else {
+        f64.d = value;
+        cbor_byte(CBOR_FLOAT64);
+        for (bytes = 8; bytes-- > 0;)
+            cbor_byte((int)(f64.u >> (bytes * 8)) & 0xff);
+    }
 }
 
 void pstart()
 {
+    pneed(PLINE);
+    if (cbor_mode) {
+        pchars(CBOR_SELF_DESCRIBE, 3);
+        cbor_byte(CBOR_MAP_START);
+        return;
+    }
     DEBUG praw("START");
     praw("{\n");
 }
 
 void pfinish()
 {
+    pneed(PLINE);
+    if (cbor_mode) {
+        cbor_byte(CBOR_BREAK);
+        return;
+    }
     DEBUG praw("FINISH");
     remove_ending_comma_if_any();
     praw("}\n");
 }
 
-char* saved_section;
-char* saved_resource;
-long saved_level = 1;
+__thread char* saved_section;
+__thread char* saved_resource;
+__thread long saved_level = 1;
 
 void indent()
 {
-    int i;
+    long i;
     DEBUG praw("INDENT");
 
-    for (i = 0; i < saved_level; i++)
-        praw("\t");
+    for (i = saved_level; i > TABS_MAX; i -= TABS_MAX)
+        pchars(tabs, TABS_MAX);
+    pchars(tabs, i);
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   positional snapshots (-K)
+*    positional_depth is -1 outside a snapshot, 0 at the snapshot level and counts
+*    the open sections inside it. The values go straight into output while the
+*    names are collected in schema[] and compared to the previous snapshot.
+*/
+__thread long positional_depth = -1;
+long positional_start; /* output offset of the first byte inside the snapshot */
+__thread char* schema = NULL;
+__thread long schema_size = 0;
+__thread long schema_char = 0;
+char* schema_previous = NULL;
+long schema_previous_char = -1;
+
+void schema_check(long len)
+{
+    if (schema_char + len >= schema_size) {
+        schema_size = schema_char + len + 64 * 1024;
+        schema = realloc(schema, schema_size);
+    }
+}
+
+/* add prefix and name as one token to the schema */
+void schema_token(char* prefix, char* name)
+{
+    long plen = strlen(prefix);
+    long nlen = strlen(name);
+    char* save_output = output;
+    long save_char = output_char;
+
+    schema_check(plen + nlen + 16);
+    /* borrow the p function writers by pointing them at the schema */
+    output = schema;
+    output_char = schema_char;
+    if (cbor_mode) {
+        cbor_head(CBOR_TEXT, plen + nlen);
+    } else
+        pchars("\"", 1);
+    pchars(prefix, plen);
+    pchars(name, nlen);
+    if (!cbor_mode)
+        pchars("\", ", 3);
+    schema_char = output_char;
+    output = save_output;
+    output_char = save_char;
+}
+
+/* after a value in JSON positional mode */
+void pvalue_end()
+{
+    if (!cbor_mode)
+        pchars(", ", 2);
+}
+
+void positional_snapshot()
+{
+    positional_depth = 0;
+    schema_char = 0;
+    if (cbor_mode) {
+        cbor_byte(CBOR_MAP_START);
+        positional_start = output_char;
+        cbor_text("values");
+        cbor_byte(CBOR_ARRAY_START);
+        return;
+    }
+    praw("{\n");
+    saved_level++;
+    positional_start = output_char;
+    indent();
+    pname("values", 6);
+    pchars("[", 1);
+}
+
+void positional_snapshot_end(int no_comma)
+{
+    long len;
+    long end;
+
+    positional_depth = -1;
+    if (cbor_mode) {
+        cbor_byte(CBOR_BREAK);
+        cbor_byte(CBOR_BREAK);
+    } else {
+        if (output[output_char - 2] == ',') /* remove the last ", " */
+            output_char -= 2;
+        pchars("]\n", 2);
+        saved_level--;
+        indent();
+        pchars(no_comma ? "}" : "},", no_comma ? 1 : 2);
+        if (schema_char >= 2)
+            schema_char -= 2; /* remove the last ", " */
+    }
+
+    if (schema_char == schema_previous_char && !memcmp(schema, schema_previous, schema_char))
+        return;
+
+    /* new schema: open a gap in front of the values and write the schema record into it */
+    if (cbor_mode)
+        len = 7 + 1 + schema_char + 1; /* "schema" [ tokens break */
+    else
+        len = (saved_level + 1) + 11 + schema_char + 3; /* tabs "schema": [ tokens ],newline */
+    pneed(len);
+    memmove(&output[positional_start + len], &output[positional_start], output_char - positional_start);
+    end = output_char + len;
+    output_char = positional_start;
+    if (cbor_mode) {
+        cbor_text("schema");
+        cbor_byte(CBOR_ARRAY_START);
+        pchars(schema, schema_char);
+        cbor_byte(CBOR_BREAK);
+    } else {
+        saved_level++;
+        indent();
+        saved_level--;
+        pname("schema", 6);
+        pchars("[", 1);
+        pchars(schema, schema_char);
+        pchars("],\n", 3);
+    }
+    output_char = end;
+    output[output_char] = 0;
+
+    schema_previous = realloc(schema_previous, schema_size);
+    memcpy(schema_previous, schema, schema_char);
+    schema_previous_char = schema_char;
 }
 
 void parrayelement()
 {
+    pneed(saved_level + PLINE);
+    if (positional_mode && positional_depth < 0) {
+        positional_snapshot();
+        return;
+    }
+    if (positional_depth >= 0) {
+        schema_token("{", "");
+        positional_depth++;
+        return;
+    }
+    if (cbor_mode) {
+        cbor_byte(CBOR_MAP_START);
+        return;
+    }
     DEBUG praw("SNAPSHOT");
     praw("{\n"); /* start of snapshot */
     saved_level++;
@@ -285,6 +707,20 @@ void parrayelement()
 
 void parrayelementend(int no_comma)
 {
+    pneed(saved_level + PLINE);
+    if (positional_depth == 0) {
+        positional_snapshot_end(no_comma);
+        return;
+    }
+    if (positional_depth > 0) {
+        schema_token("}", "");
+        positional_depth--;
+        return;
+    }
+    if (cbor_mode) {
+        cbor_byte(CBOR_BREAK);
+        return;
+    }
     DEBUG praw("SNAPSHOTEND");
     remove_ending_comma_if_any();
     saved_level--;
@@ -297,35 +733,84 @@ void parrayelementend(int no_comma)
 
 void psection(char* section)
 {
-    buffer_check();
+    long len = strlen(section);
+
+    pneed(saved_level + len + PLINE);
     precimon_sections++;
     saved_section = section;
+    if (positional_depth >= 0) {
+        schema_token("{", section);
+        positional_depth++;
+        return;
+    }
+    if (cbor_mode) {
+        cbor_text(section);
+        cbor_byte(CBOR_MAP_START);
+        return;
+    }
     indent();
-    output_char += sprintf(&output[output_char], "\"%s\": {\n", section);
+    pname(section, len);
+    pchars("{\n", 2);
     saved_level++;
 }
 
 void parray(const char* arrayname)
 {
-    buffer_check();
+    long len = strlen(arrayname);
+
+    pneed(saved_level + len + PLINE);
     precimon_sections++;
+    if (positional_depth >= 0) {
+        schema_token("[", (char*)arrayname);
+        positional_depth++;
+        return;
+    }
+    if (cbor_mode) {
+        cbor_text((char*)arrayname);
+        cbor_byte(CBOR_ARRAY_START);
+        return;
+    }
     indent();
-    output_char += sprintf(&output[output_char], "\"%s\": [", arrayname);
+    pname((char*)arrayname, len);
+    pchars("[", 1);
 }
 
 void psub(char* resource)
 {
-    buffer_check();
+    long len = strlen(resource);
+
+    pneed(saved_level + len + PLINE);
     precimon_subsections++;
     saved_resource = resource;
+    if (positional_depth >= 0) {
+        schema_token("{", resource);
+        positional_depth++;
+        return;
+    }
+    if (cbor_mode) {
+        cbor_text(resource);
+        cbor_byte(CBOR_MAP_START);
+        return;
+    }
     indent();
-    output_char += sprintf(&output[output_char], "\"%s\": {\n", resource);
+    pname(resource, len);
+    pchars("{\n", 2);
     saved_level++;
 }
 
 void psubend()
 {
+    pneed(saved_level + PLINE);
     saved_resource = NULL;
+    if (positional_depth >= 0) {
+        schema_token("}", "");
+        positional_depth--;
+        return;
+    }
+    if (cbor_mode) {
+        cbor_byte(CBOR_BREAK);
+        return;
+    }
     remove_ending_comma_if_any();
     saved_level--;
     indent();
@@ -334,8 +819,18 @@ void psubend()
 
 void psectionend()
 {
+    pneed(saved_level + PLINE);
     saved_section = NULL;
     saved_resource = NULL;
+    if (positional_depth >= 0) {
+        schema_token("}", "");
+        positional_depth--;
+        return;
+    }
+    if (cbor_mode) {
+        cbor_byte(CBOR_BREAK);
+        return;
+    }
     saved_level--;
     remove_ending_comma_if_any();
     indent();
@@ -344,10 +839,20 @@ void psectionend()
 
 void parrayend()
 {
+    pneed(PLINE);
     saved_section = NULL;
     saved_resource = NULL;
+    if (positional_depth >= 0) {
+        schema_token("]", "");
+        positional_depth--;
+        return;
+    }
+    if (cbor_mode) {
+        cbor_byte(CBOR_BREAK);
+        return;
+    }
 
-    if (output[output_char - 1] == ',') {
+    if (output_char >= 1 && output[output_char - 1] == ',') {
         output_char--;
     }
     praw("],\n");
@@ -355,33 +860,275 @@ void parrayend()
 
 void phex(char* name, long long value)
 {
-    indent();
+    long len = strlen(name);
+
+    pneed(saved_level + len + PLINE + PNUMBER);
     precimon_hex++;
-    output_char += sprintf(&output[output_char], "\"%s\": \"0x%08llx\",\n", name, value);
+    if (positional_depth >= 0)
+        schema_token("", name);
+    else if (cbor_mode)
+        cbor_text(name);
+    if (cbor_mode) {
+        cbor_head(CBOR_TAG, CBOR_TAG_BASE16);
+        cbor_head(CBOR_UNSIGNED, value);
+        return;
+    }
+    if (positional_depth >= 0) {
+        pchars("\"0x", 3);
+        phexdigits(value);
+        pchars("\"", 1);
+        pvalue_end();
+        return;
+    }
+    indent();
+    pname(name, len);
+    pchars("\"0x", 3);
+    phexdigits(value);
+    pchars("\"", 1);
+    pendline();
     DEBUG printf("plong(%s,%lld) count=%ld\n", name, value, output_char);
 }
 
 void plong(char* name, long long value)
 {
-    indent();
+    long len = strlen(name);
+
+    pneed(saved_level + len + PLINE + PNUMBER);
     precimon_long++;
-    output_char += sprintf(&output[output_char], "\"%s\": %lld,\n", name, value);
+    if (positional_depth >= 0)
+        schema_token("", name);
+    else if (cbor_mode)
+        cbor_text(name);
+    if (cbor_mode) {
+        cbor_long(value);
+        return;
+    }
+    if (positional_depth >= 0) {
+        pnumber(value);
+        pvalue_end();
+        return;
+    }
+    indent();
+    pname(name, len);
+    pnumber(value);
+    pendline();
     DEBUG printf("plong(%s,%lld) count=%ld\n", name, value, output_char);
 }
 
 void pulong(char* name, long long unsigned value)
 {
-    indent();
+    long len = strlen(name);
+
+    pneed(saved_level + len + PLINE + PNUMBER);
     precimon_long++;
-    output_char += sprintf(&output[output_char], "\"%s\": %llu,\n", name, value);
+    if (positional_depth >= 0)
+        schema_token("", name);
+    else if (cbor_mode)
+        cbor_text(name);
+    if (cbor_mode) {
+        cbor_head(CBOR_UNSIGNED, value);
+        return;
+    }
+    if (positional_depth >= 0) {
+        pdigits(value);
+        pvalue_end();
+        return;
+    }
+    indent();
+    pname(name, len);
+    pdigits(value);
+    pendline();
     DEBUG printf("plong(%s,%lld) count=%ld\n", name, value, output_char);
 }
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   aggregation (-a fast_interval)
+*    the CPU, disk and network collectors sample every fast_interval but are
+*    only output at their normal period. While aggregating pdouble() feeds its
+*    value to the accumulator keyed by section/resource/name, looked for first
+*    at the n-th place as the order rarely changes, and at the output it writes
+*    name_min, name_mean, name_max and name_p95 instead.
+*    The p95 is a P-square estimate (Jain and Chlamtac) so an accumulator is a
+*    fixed size however many samples the window holds.
+*/
+#define AGGREGATE_P 0.95
+
+struct accumulator {
+    char key[128]; /* section/resource/name */
+    long count;
+    double min;
+    double max;
+    double sum;
+    double q[5]; /* marker heights, q[2] is the p95 */
+    double n[5]; /* marker positions */
+    double np[5]; /* desired marker positions */
+};
+
+struct aggregate {
+    struct accumulator* a;
+    long size;
+    long used;
+    long next; /* the accumulator for the next pdouble() */
+};
+
+long long unsigned aggregate_interval = 0; /* -a in nanoseconds */
+__thread struct aggregate* aggregating = NULL; /* set while an aggregated collector runs */
+__thread int aggregate_output = 0; /* this run ends the window */
+
+void pdouble(char* name, double value);
+
+void accumulator_reset(struct accumulator* a, char* key)
+{
+    memset(a, 0, sizeof(struct accumulator));
+    snprintf(a->key, sizeof(a->key), "%s", key);
+}
+
+void accumulator_add(struct accumulator* a, double x)
+{
+    static double dn[5] = { 0.0, AGGREGATE_P / 2.0, AGGREGATE_P, (1.0 + AGGREGATE_P) / 2.0, 1.0 };
+    double d;
+    double qp;
+    double t;
+    int ds;
+    int i;
+    int k;
+
+    if (a->count == 0 || x < a->min)
+        a->min = x;
+    if (a->count == 0 || x > a->max)
+        a->max = x;
+    a->sum += x;
+
+    if (a->count < 5) { /* the first five are kept sorted */
+        for (i = a->count; i > 0 && a->q[i - 1] > x; i--)
+            a->q[i] = a->q[i - 1];
+        a->q[i] = x;
+        if (++a->count == 5) {
+            for (i = 0; i < 5; i++)
+                a->n[i] = i + 1;
+            a->np[0] = 1.0;
+            a->np[1] = 1.0 + 2.0 * AGGREGATE_P;
+            a->np[2] = 1.0 + 4.0 * AGGREGATE_P;
+            a->np[3] = 3.0 + 2.0 * AGGREGATE_P;
+            a->np[4] = 5.0;
+        }
+        return;
+    }
+    a->count++;
+
+    if (x < a->q[0]) {
+        a->q[0] = x;
+        k = 0;
+    } else if (x >= a->q[4]) {
+        a->q[4] = x;
+        k = 3;
+    } else {
+        for (k = 0; k < 3 && x >= a->q[k + 1]; k++)
+            ;
+    }
+    for (i = k + 1; i < 5; i++)
+        a->n[i]++;
+    for (i = 0; i < 5; i++)
+        a->np[i] += dn[i];
+
+    for (i = 1; i < 4; i++) { /* move the middle markers towards where they should be */
+        d = a->np[i] - a->n[i];
+        if ((d >= 1.0 && a->n[i + 1] - a->n[i] > 1.0) || (d <= -1.0 && a->n[i - 1] - a->n[i] < -1.0)) {
+            ds = d > 0 ? 1 : -1;
+            qp = a->q[i] + ds / (a->n[i + 1] - a->n[i - 1]) * ((a->n[i] - a->n[i - 1] + ds) * (a->q[i + 1] - a->q[i]) / (a->n[i + 1] - a->n[i]) + (a->n[i + 1] - a->n[i] - ds) * (a->q[i] - a->q[i - 1]) / (a->n[i] - a->n[i - 1]));
+            if (a->q[i - 1] < qp && qp < a->q[i + 1]) {
+                a->q[i] = qp;
+            } else {
+                t = a->q[i + ds];
+                a->q[i] += ds * (t - a->q[i]) / (a->n[i + ds] - a->n[i]);
+            }
+            a->n[i] += ds;
+        }
+    }
+}
+
+double accumulator_p95(struct accumulator* a)
+{
+    if (a->count >= 5)
+        return a->q[2];
+    return a->q[(long)(AGGREGATE_P * a->count)]; /* nearest rank of the few there are */
+}
+
+void aggregate_pdouble(char* name, double value)
+{
+    struct aggregate* g = aggregating;
+    struct accumulator* a;
+    struct accumulator swap;
+    char key[128];
+    char label[64];
+    long i;
+
+    snprintf(key, sizeof(key), "%s/%s/%s", saved_section ? saved_section : "", saved_resource ? saved_resource : "", name);
+    key[sizeof(key) - 1] = 0;
+    if (g->used == g->size) {
+        g->size = g->size * 2 + 64;
+        g->a = realloc(g->a, sizeof(struct accumulator) * g->size);
+    }
+    a = &g->a[g->next];
+    if (g->next == g->used || strncmp(a->key, key, sizeof(a->key) - 1)) { /* devices came or went */
+        for (i = g->next + 1; i < g->used && strncmp(g->a[i].key, key, sizeof(a->key) - 1); i++)
+            ;
+        if (i < g->used) { /* further on, bring it here */
+            swap = *a;
+            *a = g->a[i];
+            g->a[i] = swap;
+        } else { /* new, what was here goes to the end until the window is output */
+            if (g->next < g->used)
+                g->a[g->used] = *a;
+            g->used++;
+            accumulator_reset(a, key);
+        }
+    }
+    g->next++;
+    accumulator_add(a, value);
+    if (!aggregate_output)
+        return;
+
+    aggregating = NULL; /* the real pdouble() from here */
+    snprintf(label, sizeof(label), "%s_min", name);
+    pdouble(label, a->min);
+    snprintf(label, sizeof(label), "%s_mean", name);
+    pdouble(label, a->sum / a->count);
+    snprintf(label, sizeof(label), "%s_max", name);
+    pdouble(label, a->max);
+    snprintf(label, sizeof(label), "%s_p95", name);
+    pdouble(label, accumulator_p95(a));
+    aggregating = g;
+    accumulator_reset(a, key);
+}
+
 void pdouble(char* name, double value)
 {
-    indent();
+    long len = strlen(name);
+
+    if (aggregating != NULL) {
+        aggregate_pdouble(name, value);
+        return;
+    }
+    pneed(saved_level + len + PLINE + PDOUBLE);
     precimon_double++;
-    output_char += sprintf(&output[output_char], "\"%s\": %.3f,\n", name, value);
+    if (positional_depth >= 0)
+        schema_token("", name);
+    else if (cbor_mode)
+        cbor_text(name);
+    if (cbor_mode) {
+        cbor_double(value);
+        return;
+    }
+    if (positional_depth >= 0) {
+        pfixed3(value);
+        pvalue_end();
+        return;
+    }
+    indent();
+    pname(name, len);
+    pfixed3(value);
+    pendline();
     DEBUG printf("pdouble(%s,%.1f) count=%ld\n", name, value, output_char);
 }
 
@@ -394,44 +1141,48 @@ void pstats()
     plong("long", precimon_long);
     plong("double", precimon_double);
     plong("hex", precimon_hex);
+    plong("output_arena_size", output_size);
+    plong("output_high_water", output_high_water);
+    plong("output_reallocs", output_reallocs);
+    if (writer_policy != WRITER_OFF) {
+        plong("writer_queued_bytes", writer_queued_bytes);
+        plong("writer_dropped_bytes", writer_dropped_bytes);
+        plong("writer_stalled_bytes", writer_stalled_bytes);
+    }
     psectionend();
 }
 
 void pstring(char* name, char* value)
 {
-    buffer_check();
+    long len = strlen(name);
+    long value_len = strlen(value);
+
+    pneed(saved_level + len + value_len + PLINE);
     precimon_string++;
+    if (positional_depth >= 0)
+        schema_token("", name);
+    else if (cbor_mode)
+        cbor_text(name);
+    if (cbor_mode) {
+        cbor_text(value);
+        return;
+    }
+    if (positional_depth >= 0) {
+        pchars("\"", 1);
+        pchars(value, value_len);
+        pchars("\"", 1);
+        pvalue_end();
+        return;
+    }
     indent();
-    output_char += sprintf(&output[output_char], "\"%s\": \"%s\",\n", name, value);
+    pname(name, len);
+    pchars("\"", 1);
+    pchars(value, value_len);
+    pchars("\"", 1);
+    pendline();
     DEBUG printf("pstring(%s,%s) count=%ld\n", name, value, output_char);
 }
 
-void push()
-{
-    FUNCTION_START;
-    buffer_check();
-    DEBUG printf("XXX size=%ld\n", output_char);
-
-    if (write(sockfd, output, output_char) < 0) {
-        perror("precimon write to stdout failed, stopping now.");
-        exit(99);
-    }
-
-    fflush(NULL); /* force I/O output now */
-    DEBUG printf("YYY size=%ld\n", output_char);
-    output[0] = 0;
-    output_char = 0;
-}
-
-int error(char* buf)
-{
-    printf("ERROR: %s\n", buf);
-    exit(1);
-}
-
-time_t timer; /* used to work out the time details*/
-struct tm* tim; /* used to work out the local hour/min/second */
-
 long long unsigned nanomonotime()
 {
     struct timespec tspec;
@@ -443,28 +1194,1029 @@ long long unsigned nanomonotime()
     return tspec.tv_sec * 1e9 + tspec.tv_nsec;
 }
 
-void nanomonosleep(long sec, long nsec)
-{
-    struct timespec tspec;
-    long sum;
-    clock_gettime(CLOCK_MONOTONIC, &tspec);
-    sum = tspec.tv_nsec + nsec;
-    tspec.tv_nsec = sum % (long)1e9;
-    tspec.tv_sec += sec + (long)(sum / 1e9);
-    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tspec, NULL);
-}
+/* when a source was read: the rates divide by the time between two reads of
+ * the same source, so the wake up lateness and the collectors before it do not
+ * skew them, and the sections say when ("sampled_at" in nanomonotime() units) */
+struct source_time {
+    long long unsigned now;
+    long long unsigned previous;
+};
 
-void get_time()
+/* stamp a read, returns the seconds since the previous one or 0 the first time */
+double source_read(struct source_time* t)
 {
-    timer = time(0);
+    t->previous = t->now;
+    t->now = nanomonotime();
+    return t->previous == 0 ? 0.0 : (t->now - t->previous) * 1e-9;
 }
 
-void get_localtime()
-{
-    tim = localtime(&timer);
-    tim->tm_year += 1900; /* read localtime() manual page!! */
-    tim->tm_mon += 1; /* because it is 0 to 11 */
-}
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   /proc and /sys reader
+*    a procfile keeps its file open and each sample is one pread() from offset 0
+*    into a buffer that grows to fit the file and is then reused, procfile_gets()
+*    hands out the lines like fgets(). No stdio, no malloc once it is sized and
+*    one system call per source per sample. A short read with a page to spare is
+*    the end of the file as /proc fills the buffer with every line that fits,
+*    except that a seq_file like /proc/net/dev hands out a page at most per
+*    read, so a read of between half a page and a page is read on from.
+*/
+#define PROCFILE_SLACK 4096
+
+struct procfile {
+    char* filename;
+    int fd; /* -1 until it is opened */
+    char* buf;
+    long size;
+    long len;
+    long next; /* offset of the next line for procfile_gets() */
+};
+
+atomic_long procfile_syscalls; /* open(), pread() and close() for the -T timers */
+
+/* read the whole file, returns its length or -1 if it is not there */
+long procfile_read(struct procfile* pf)
+{
+    static long page = 0;
+    long ret;
+
+    if (page == 0)
+        page = sysconf(_SC_PAGESIZE);
+    if (pf->fd < 0) {
+        atomic_fetch_add_explicit(&procfile_syscalls, 1, memory_order_relaxed);
+        if ((pf->fd = open(pf->filename, O_RDONLY | O_CLOEXEC)) < 0)
+            return -1;
+    }
+    pf->len = 0;
+    pf->next = 0;
+    for (;;) {
+        if (pf->size - pf->len <= PROCFILE_SLACK) {
+            pf->size = pf->size * 2 + PROCFILE_SLACK * 2;
+            pf->buf = realloc(pf->buf, pf->size);
+        }
+        atomic_fetch_add_explicit(&procfile_syscalls, 1, memory_order_relaxed);
+        ret = pread(pf->fd, &pf->buf[pf->len], pf->size - pf->len - 1, pf->len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            close(pf->fd); /* the file went, open it again next time */
+            pf->fd = -1;
+            return -1;
+        }
+        pf->len += ret;
+        if (ret == 0 || (pf->size - pf->len - 1 > PROCFILE_SLACK && (ret < page / 2 || ret > page)))
+            break;
+    }
+    pf->buf[pf->len] = 0;
+    return pf->len;
+}
+
+/* the next line with its newline like fgets() or NULL at the end */
+char* procfile_gets(char* line, long size, struct procfile* pf)
+{
+    char* end;
+    long len;
+
+    if (pf->next >= pf->len)
+        return NULL;
+    if ((end = memchr(&pf->buf[pf->next], '\n', pf->len - pf->next)) != NULL)
+        len = end - &pf->buf[pf->next] + 1;
+    else
+        len = pf->len - pf->next;
+    if (len > size - 1)
+        len = size - 1;
+    memcpy(line, &pf->buf[pf->next], len);
+    line[len] = 0;
+    pf->next += len;
+    return line;
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   field scanner
+*    the /proc parsers used sscanf() which works through its format string for
+*    every field of every line. These walk the line once: skip the blanks then
+*    gather the digits with a single unsigned compare per character. Numbers are
+*    collected as unsigned and a leading '-' negates them, so the %lu fields with
+*    all bits set (like rsslimit) come out as they did from sscanf().
+*/
+#define SCAN_DIGIT(c) ((unsigned char)((c) - '0') <= 9)
+#define SCAN_BLANK(c) ((c) == ' ' || (c) == '\t')
+
+/* one integer, returns where it ended or NULL when there is no number */
+static inline char* scan_number(char* s, long long* value)
+{
+    unsigned long long v = 0;
+    int negative;
+
+    while (SCAN_BLANK(*s))
+        s++;
+    negative = (*s == '-');
+    s += negative;
+    if (!SCAN_DIGIT(*s))
+        return NULL;
+    do
+        v = v * 10 + (*s++ - '0');
+    while (SCAN_DIGIT(*s));
+    *value = negative ? -(long long)v : (long long)v;
+    return s;
+}
+
+/* up to max integers from *line, moves *line past them and returns how many like sscanf() */
+int scan_numbers(char** line, long long* values, int max)
+{
+    char* s = *line;
+    char* next;
+    int i;
+
+    for (i = 0; i < max && (next = scan_number(s, &values[i])) != NULL; i++)
+        s = next;
+    *line = s;
+    return i;
+}
+
+/* the next blank separated word like %s, truncated to size, returns 0 when there is none */
+int scan_word(char** line, char* word, int size)
+{
+    char* s = *line;
+    int len = 0;
+
+    while (SCAN_BLANK(*s))
+        s++;
+    while (*s != 0 && !SCAN_BLANK(*s) && *s != '\n') {
+        if (len < size - 1)
+            word[len++] = *s;
+        s++;
+    }
+    word[len] = 0;
+    *line = s;
+    return len > 0;
+}
+
+/* open, read and close for files that come and go like /proc/<pid>/stat */
+long procfile_once(char* filename, char* buf, long size)
+{
+    int fd;
+    long len;
+
+    atomic_fetch_add_explicit(&procfile_syscalls, 3, memory_order_relaxed);
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    len = pread(fd, buf, size - 1, 0);
+    close(fd);
+    if (len >= 0)
+        buf[len] = 0;
+    return len;
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   latency histograms (-H snapshots)
+*    HDR style log-linear buckets of nanoseconds: values below 128 have a bucket
+*    each, above that every power of two is split into 64 buckets so a percentile
+*    is within 1.6% of the real value whatever the range. Recording is an index
+*    and an increment so it can go in the sampling loop.
+*/
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_HALF (1 << (HISTOGRAM_SUB_BITS - 1))
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_HALF + HISTOGRAM_HALF)
+
+struct histogram {
+    long long unsigned count;
+    long long unsigned max;
+    long long unsigned buckets[HISTOGRAM_BUCKETS];
+};
+
+long histogram_every = 0; /* -H emit the summaries every this many snapshots */
+struct histogram wake_histogram; /* how late the sampler woke after its deadline */
+struct histogram push_histogram; /* push() to standard output, the socket or the writer */
+
+void histogram_record(struct histogram* h, long long unsigned value)
+{
+    int shift = 0;
+
+    if (value >= (1 << HISTOGRAM_SUB_BITS))
+        shift = 64 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    h->buckets[shift * HISTOGRAM_HALF + (value >> shift)]++;
+    h->count++;
+    if (value > h->max)
+        h->max = value;
+}
+
+/* the highest value in the bucket the percentile falls in */
+long long unsigned histogram_percentile(struct histogram* h, double percent)
+{
+    long long unsigned want = (long long unsigned)(h->count * percent / 100.0 + 0.5);
+    long long unsigned seen = 0;
+    long long unsigned value;
+    long i;
+
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) {
+            if (i < (1 << HISTOGRAM_SUB_BITS))
+                value = i;
+            else
+                value = ((long long unsigned)(i % HISTOGRAM_HALF + HISTOGRAM_HALF + 1) << (i / HISTOGRAM_HALF - 1)) - 1;
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* percentile summary then start again for the next period */
+void histogram_summary(char* name, struct histogram* h)
+{
+    psub(name);
+    pulong("count", h->count);
+    pulong("p50", histogram_percentile(h, 50.0));
+    pulong("p99", histogram_percentile(h, 99.0));
+    pulong("p99_9", histogram_percentile(h, 99.9));
+    pulong("max", h->max);
+    psubend();
+    memset(h, 0, sizeof(struct histogram));
+}
+
+/* write() all of it, sockets can take less than asked */
+void write_all(char* buf, long len)
+{
+    long ret;
+
+    while (len > 0) {
+        if ((ret = write(sockfd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("precimon write to stdout failed, stopping now.");
+            exit(99);
+        }
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   asynchronous writer (-w policy[,slots])
+*    push() hands the filled output buffer to a single-producer/single-consumer
+*    ring and carries on with an empty one, the writer thread does the write()
+*    so a slow disk or collector does not delay the next snapshot.
+*
+*    writer_head  next slot the sampler fills, only the sampler moves it
+*    writer_tail  next slot to write, the writer claims a slot by moving it with
+*                 compare and swap, so does the sampler when it drops the oldest
+*    writer_free  the other way round: buffers the writer is done with
+*
+*    when the ring is full the policy decides:
+*       drop   the oldest queued snapshot is thrown away
+*       block  the sampler waits for the writer
+*       spill  snapshots go to an unlinked spill file until the writer caught up
+*/
+
+struct writer_buffer {
+    char* data;
+    long size;
+    long used;
+};
+struct writer_buffer* _Atomic* writer_ring;
+atomic_llong writer_head;
+atomic_llong writer_tail;
+struct writer_buffer* _Atomic* writer_free;
+atomic_llong writer_free_head;
+atomic_llong writer_free_tail;
+struct writer_buffer* writer_current; /* the sampler fills this one = output */
+struct writer_buffer* writer_spare = NULL; /* a dropped buffer to reuse */
+long writer_buffers = 0;
+
+pthread_t writer;
+sem_t writer_wakeup; /* posted when there is something to write */
+sem_t writer_space; /* posted when a slot was taken off the ring while the sampler waits */
+atomic_int writer_waiting; /* set by the sampler before it waits, taken by whoever posts */
+atomic_int writer_stopping;
+
+int spill_fd = -1;
+atomic_llong spill_written;
+atomic_llong spill_replayed;
+
+void* writer_main(void* arg)
+{
+    static char spill_buffer[64 * 1024];
+    struct writer_buffer* b;
+    long long tail;
+    long long done;
+    long len;
+
+    for (;;) {
+        tail = atomic_load(&writer_tail);
+        if (tail < atomic_load(&writer_head)) {
+            b = atomic_load(&writer_ring[tail % writer_slots]);
+            if (!atomic_compare_exchange_strong(&writer_tail, &tail, tail + 1))
+                continue; /* the sampler dropped it */
+            if (atomic_exchange(&writer_waiting, 0))
+                sem_post(&writer_space);
+            write_all(b->data, b->used);
+            fflush(NULL); /* force I/O output now */
+            atomic_store(&writer_free[atomic_load(&writer_free_head) % (writer_slots + 2)], b);
+            atomic_fetch_add(&writer_free_head, 1);
+            continue;
+        }
+        done = atomic_load(&spill_replayed);
+        if (done < atomic_load(&spill_written)) {
+            len = atomic_load(&spill_written) - done;
+            if (len > (long)sizeof(spill_buffer))
+                len = sizeof(spill_buffer);
+            if ((len = pread(spill_fd, spill_buffer, len, done)) <= 0) {
+                perror("precimon spill file read failed, stopping now.");
+                exit(99);
+            }
+            write_all(spill_buffer, len);
+            fallocate(spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, done, len); /* give the disk back */
+            atomic_store(&spill_replayed, done + len);
+            continue;
+        }
+        if (atomic_load(&writer_stopping))
+            break;
+        sem_wait(&writer_wakeup);
+    }
+    return NULL;
+}
+
+void writer_use(struct writer_buffer* b)
+{
+    if (b->size < output_size) { /* the arena grew since this buffer was made */
+        free(b->data);
+        b->data = malloc(output_size);
+        b->size = output_size;
+    }
+    writer_current = b;
+    output = b->data;
+    output_size = b->size;
+    output_char = 0;
+    output[0] = 0;
+}
+
+void writer_start()
+{
+    writer_ring = calloc(writer_slots, sizeof(struct writer_buffer*));
+    writer_free = calloc(writer_slots + 2, sizeof(struct writer_buffer*));
+    sem_init(&writer_wakeup, 0, 0);
+    sem_init(&writer_space, 0, 0);
+
+    /* the arena becomes the first buffer */
+    writer_current = malloc(sizeof(struct writer_buffer));
+    writer_current->data = output;
+    writer_current->size = output_size;
+    writer_buffers = 1;
+
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0)
+        pexit("precimon: writer thread pthread_create() failed");
+}
+
+void writer_spill()
+{
+    char filename[64];
+    long long written = atomic_load(&spill_written);
+    long done;
+    long ret;
+
+    if (spill_fd == -1) {
+        snprintf(filename, sizeof(filename), "precimon_%d.spill", getpid());
+        if ((spill_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1)
+            pexit("precimon: opening the spill file failed");
+        unlink(filename); /* gone when precimon stops */
+    }
+    for (done = 0; done < output_char; done += ret) {
+        if ((ret = pwrite(spill_fd, &output[done], output_char - done, written + done)) < 0)
+            pexit("precimon: writing the spill file failed");
+    }
+    writer_stalled_bytes += output_char;
+    atomic_store(&spill_written, written + output_char);
+    sem_post(&writer_wakeup);
+    output_char = 0;
+    output[0] = 0;
+}
+
+void writer_push()
+{
+    struct writer_buffer* b;
+    long long head = atomic_load(&writer_head);
+    long long tail;
+    int stalled = 0;
+
+    /* pneed() may have moved the arena */
+    writer_current->data = output;
+    writer_current->size = output_size;
+    if (writer_policy == WRITER_SPILL && atomic_load(&spill_written) > atomic_load(&spill_replayed)) {
+        writer_spill(); /* keep the order: everything goes to the spill file until it is written */
+        return;
+    }
+    while (head - (tail = atomic_load(&writer_tail)) >= writer_slots) { /* full */
+        switch (writer_policy) {
+        case WRITER_DROP:
+            b = atomic_load(&writer_ring[tail % writer_slots]);
+            if (atomic_compare_exchange_strong(&writer_tail, &tail, tail + 1)) {
+                writer_dropped_bytes += b->used;
+                writer_spare = b;
+            }
+            break;
+        case WRITER_BLOCK:
+            if (!stalled)
+                writer_stalled_bytes += output_char;
+            stalled = 1;
+            atomic_store(&writer_waiting, 1);
+            /* still full, or the writer took the flag so its post is on the way */
+            if (head - atomic_load(&writer_tail) >= writer_slots || !atomic_exchange(&writer_waiting, 0))
+                while (sem_wait(&writer_space) < 0 && errno == EINTR)
+                    ;
+            break;
+        case WRITER_SPILL:
+            writer_spill();
+            return;
+        }
+    }
+    writer_current->used = output_char;
+    atomic_store(&writer_ring[head % writer_slots], writer_current);
+    atomic_store(&writer_head, head + 1);
+    writer_queued_bytes += output_char;
+    sem_post(&writer_wakeup);
+
+    /* carry on in another buffer */
+    if (writer_spare != NULL) {
+        b = writer_spare;
+        writer_spare = NULL;
+    } else if (atomic_load(&writer_free_tail) < atomic_load(&writer_free_head)) {
+        b = atomic_load(&writer_free[atomic_load(&writer_free_tail) % (writer_slots + 2)]);
+        atomic_fetch_add(&writer_free_tail, 1);
+    } else {
+        b = malloc(sizeof(struct writer_buffer));
+        b->data = malloc(output_size);
+        b->size = output_size;
+        writer_buffers++;
+    }
+    writer_use(b);
+}
+
+/* let the writer empty the ring and the spill file then stop it */
+void writer_finish()
+{
+    atomic_store(&writer_stopping, 1);
+    sem_post(&writer_wakeup);
+    pthread_join(writer, NULL);
+}
+
+void push()
+{
+    long long unsigned push_start = nanomonotime();
+
+    FUNCTION_START;
+    if (output_char > output_high_water)
+        output_high_water = output_char;
+    DEBUG printf("XXX size=%ld\n", output_char);
+
+    if (writer_policy != WRITER_OFF) {
+        writer_push();
+    } else {
+        write_all(output, output_char);
+
+        fflush(NULL); /* force I/O output now */
+        DEBUG printf("YYY size=%ld\n", output_char);
+        output[0] = 0;
+        output_char = 0;
+    }
+    histogram_record(&push_histogram, nanomonotime() - push_start);
+}
+
+int error(char* buf)
+{
+    printf("ERROR: %s\n", buf);
+    exit(1);
+}
+
+time_t timer; /* used to work out the time details*/
+struct tm* tim; /* used to work out the local hour/min/second */
+
+/* the schedule runs on CLOCK_MONOTONIC as clock_nanosleep() can not sleep on CLOCK_MONOTONIC_RAW */
+long long unsigned nanoschedtime()
+{
+    struct timespec tspec;
+    clock_gettime(CLOCK_MONOTONIC, &tspec);
+    return tspec.tv_sec * 1000000000ULL + tspec.tv_nsec;
+}
+
+/* sleep until an absolute nanoschedtime(), a signal only cuts it short when precimon is stopping */
+void nanosleep_until(long long unsigned when)
+{
+    struct timespec tspec;
+
+    tspec.tv_sec = when / 1000000000ULL;
+    tspec.tv_nsec = when % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tspec, NULL) == EINTR && !interrupted)
+        ;
+}
+
+#define INTERVAL_MIN 1e6 /* 1ms, below it the deadlines are mostly scheduler noise */
+
+/* -s 10, -s 0.5, -s 250ms or -s 1500us in nanoseconds, 0 if the unit is unknown or it is under 1ms */
+long long unsigned interval_parse(char* arg)
+{
+    char* unit;
+    double value;
+    double scale = 1e9;
+
+    value = strtod(arg, &unit);
+    if (!strcmp(unit, "ms"))
+        scale = 1e6;
+    else if (!strcmp(unit, "us"))
+        scale = 1e3;
+    else if (unit[0] != 0 && strcmp(unit, "s"))
+        return 0;
+    if (!(value * scale >= INTERVAL_MIN)) /* zero, negative or not a number too */
+        return 0;
+    if (!isfinite(value) || value * scale >= (double)ULLONG_MAX) /* too long to hold in nanoseconds */
+        return 0;
+    return (long long unsigned)(value * scale + 0.5);
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   pressure stall information (-y, -Y triggers)
+*    /proc/pressure/{cpu,memory,io} have a "some" line, the share of time at
+*    least one task was stalled on the resource, and a "full" line, all of them
+*    at once. precimon outputs the kernel's avg10, avg60 and avg300 percentages
+*    and the microseconds of stall since the previous sample from the total.
+*    -Y memory=some:100ms/1s registers a kernel trigger: the file is opened for
+*    writing and poll() wakes precimon when the tasks stalled for 100ms within
+*    any 1s window, so it takes an extra snapshot of every collector then and
+*    there instead of at the next deadline. The kernel wants the window
+*    between 500ms and 10s, a multiple of 2s without CAP_SYS_RESOURCE, and
+*    fires a trigger at most once per window.
+*/
+#define PRESSURE_RESOURCES 3
+#define PRESSURE_TRIGGERS 16
+
+char* pressure_names[PRESSURE_RESOURCES] = { "cpu", "memory", "io" };
+
+struct pressure_line {
+    int found;
+    double avg[3]; /* avg10, avg60, avg300 */
+    long long total; /* microseconds */
+    long long previous;
+};
+
+struct pressure {
+    struct procfile file;
+    struct pressure_line line[2]; /* some, full */
+} pressure[PRESSURE_RESOURCES] = {
+    { { "/proc/pressure/cpu", -1 } },
+    { { "/proc/pressure/memory", -1 } },
+    { { "/proc/pressure/io", -1 } }
+};
+
+struct pressure_trigger {
+    char* spec; /* as given to -Y */
+    long fired;
+} pressure_trigger[PRESSURE_TRIGGERS];
+struct pollfd pressure_poll[PRESSURE_TRIGGERS];
+int pressure_triggers = 0;
+int pressure_fired = -1; /* the trigger behind this snapshot or -1 */
+
+/* -Y resource=some|full:stall/window,... registers the triggers, returns the one it could not or NULL */
+char* pressure_triggers_parse(char* arg)
+{
+    char filename[64];
+    char request[64];
+    char* spec;
+    char* kind;
+    char* stall;
+    char* window;
+    long long unsigned stall_ns;
+    long long unsigned window_ns;
+    int i;
+    int fd;
+
+    for (spec = strtok(arg, ","); spec != NULL; spec = strtok(NULL, ",")) {
+        if (pressure_triggers == PRESSURE_TRIGGERS)
+            return spec;
+        pressure_trigger[pressure_triggers].spec = strdup(spec);
+        if ((kind = strchr(spec, '=')) == NULL || (stall = strchr(kind, ':')) == NULL || (window = strchr(stall, '/')) == NULL)
+            return pressure_trigger[pressure_triggers].spec;
+        *kind++ = 0;
+        *stall++ = 0;
+        *window++ = 0;
+        for (i = 0; i < PRESSURE_RESOURCES; i++)
+            if (!strcmp(spec, pressure_names[i]))
+                break;
+        stall_ns = interval_parse(stall);
+        window_ns = interval_parse(window);
+        if (i == PRESSURE_RESOURCES || (strcmp(kind, "some") && strcmp(kind, "full"))
+            || stall_ns == 0 || window_ns < 500000000ULL || window_ns > 10000000000ULL || stall_ns > window_ns)
+            return pressure_trigger[pressure_triggers].spec;
+        snprintf(filename, sizeof(filename), "/proc/pressure/%s", pressure_names[i]);
+        snprintf(request, sizeof(request), "%s %llu %llu", kind, stall_ns / 1000, window_ns / 1000);
+        if ((fd = open(filename, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0)
+            return pressure_trigger[pressure_triggers].spec;
+        if (write(fd, request, strlen(request) + 1) < 0) {
+            perror("precimon: -Y the kernel refused the trigger (without CAP_SYS_RESOURCE the window must be a multiple of 2s)");
+            close(fd);
+            return pressure_trigger[pressure_triggers].spec;
+        }
+        pressure_poll[pressure_triggers].fd = fd;
+        pressure_poll[pressure_triggers].events = POLLPRI;
+        pressure_triggers++;
+    }
+    return NULL;
+}
+
+/* sleep like nanosleep_until() but a trigger cuts it short, returns the trigger or -1 */
+int pressure_wait(long long unsigned when)
+{
+    struct timespec tspec;
+    long long unsigned now;
+    int i;
+
+    while (!interrupted && (now = nanoschedtime()) < when) {
+        tspec.tv_sec = (when - now) / 1000000000ULL;
+        tspec.tv_nsec = (when - now) % 1000000000ULL;
+        if (ppoll(pressure_poll, pressure_triggers, &tspec, NULL) <= 0)
+            continue; /* the deadline or a signal */
+        for (i = 0; i < pressure_triggers; i++) {
+            if (pressure_poll[i].revents & POLLPRI) {
+                pressure_trigger[i].fired++;
+                return i;
+            }
+            if (pressure_poll[i].revents & (POLLERR | POLLNVAL)) {
+                fprintf(stderr, "precimon: -Y %s trigger stopped working\n", pressure_trigger[i].spec);
+                close(pressure_poll[i].fd);
+                pressure_poll[i].fd = -1; /* poll() skips it from now on */
+            }
+        }
+    }
+    return -1;
+}
+
+/* the some and full lines of a pressure file into line[0] and line[1] */
+void pressure_scan(struct procfile* file, struct pressure_line* line)
+{
+    struct pressure_line* l;
+    char buf[256];
+    char word[16];
+    char* pos;
+    int i;
+
+    /* some avg10=1.27 avg60=1.59 avg300=1.49 total=47565109 */
+    while (procfile_gets(buf, sizeof(buf), file) != NULL) {
+        pos = buf;
+        if (!scan_word(&pos, word, sizeof(word)))
+            continue;
+        l = &line[strcmp(word, "some") != 0];
+        for (i = 0; i < 3 && (pos = strchr(pos, '=')) != NULL; i++)
+            l->avg[i] = strtod(pos + 1, &pos);
+        l->previous = l->total;
+        if (i < 3 || (pos = strchr(pos, '=')) == NULL || scan_number(pos + 1, &l->total) == NULL)
+            continue;
+        if (!l->found) /* no stall to report the first time */
+            l->previous = l->total;
+        l->found = 1;
+    }
+}
+
+void proc_pressure(int print)
+{
+    struct pressure* p;
+    struct pressure_line* l;
+    char label[32];
+    int r;
+    int i;
+    int k;
+
+    FUNCTION_START;
+    if (print)
+        psection("pressure");
+    for (r = 0; r < PRESSURE_RESOURCES; r++) {
+        p = &pressure[r];
+        if (procfile_read(&p->file) < 0)
+            continue; /* no PSI in this kernel or booted with psi=0 */
+        pressure_scan(&p->file, p->line);
+        if (!print)
+            continue;
+        psub(pressure_names[r]);
+        for (k = 0; k < 2; k++) {
+            l = &p->line[k];
+            if (!l->found)
+                continue;
+            snprintf(label, sizeof(label), "%s_avg10", k ? "full" : "some");
+            pdouble(label, l->avg[0]);
+            snprintf(label, sizeof(label), "%s_avg60", k ? "full" : "some");
+            pdouble(label, l->avg[1]);
+            snprintf(label, sizeof(label), "%s_avg300", k ? "full" : "some");
+            pdouble(label, l->avg[2]);
+            snprintf(label, sizeof(label), "%s_stall_us", k ? "full" : "some");
+            pulong(label, l->total - l->previous);
+        }
+        psubend();
+    }
+    if (print) {
+        if (pressure_triggers > 0) {
+            psub("triggers");
+            for (i = 0; i < pressure_triggers; i++)
+                plong(pressure_trigger[i].spec, pressure_trigger[i].fired);
+            psubend();
+        }
+        psectionend();
+    }
+}
+
+/* the schedule: each collector has its own period (-r, default the -s interval)
+ * and its run k is due at schedule_start + k * period so it stays in phase with
+ * the start however long each snapshot takes. precimon wakes at the earliest
+ * deadline and the snapshot holds just the collectors that are due.
+ * A collector that overran one or more of its deadlines does not push the later
+ * ones back, the deadlines it overran are skipped and counted as missed.
+ */
+#define COLLECTOR_CPU 0
+#define COLLECTOR_MEMORY 1
+#define COLLECTOR_DISKS 2
+#define COLLECTOR_NETWORKS 3
+#define COLLECTOR_UPTIME 4
+#define COLLECTOR_FILESYSTEMS 5
+#define COLLECTOR_LPAR 6
+#define COLLECTOR_GPFS 7
+#define COLLECTOR_PROCESSES 8
+#define COLLECTOR_INTERRUPTS 9
+#define COLLECTOR_PRESSURE 10
+#define COLLECTOR_CGROUPS 11
+#define COLLECTORS 12
+
+struct collector {
+    char* name;
+    int enabled;
+    long long unsigned period; /* nanoseconds, 0 until -r or the -s interval sets it */
+    long long unsigned number; /* the next run is due at schedule_start + number * period */
+    int due; /* runs in this snapshot */
+    int extra; /* only because a -Y trigger fired, its deadline still stands */
+    int emit; /* and is output, only differs while aggregating */
+    int aggregate; /* -a samples every period and outputs every emit_period */
+    long long unsigned emit_period;
+    long long unsigned emit_number;
+    struct aggregate accumulators;
+    struct histogram execute; /* -H execute time */
+    char* section; /* -j the collector output until it is stitched into output */
+    long section_size;
+    long section_char;
+    char* section_schema;
+    long section_schema_size;
+    long section_schema_char;
+} collectors[COLLECTORS] = {
+    { "cpu" },
+    { "memory" },
+    { "disks" },
+    { "networks" },
+    { "uptime", 1 },
+    { "filesystems" },
+    { "lpar" },
+    { "gpfs" },
+    { "processes" },
+    { "interrupts" },
+    { "pressure" },
+    { "cgroups" },
+};
+
+long long unsigned snapshot_interval = 60000000000ULL; /* -s in nanoseconds */
+long long unsigned schedule_start;
+long long unsigned deadline; /* the earliest collector deadline */
+long long unsigned deadlines_missed = 0;
+long long unsigned deadline_lateness = 0; /* from the deadline to the wake up */
+long long unsigned deadline_lateness_max = 0;
+double deadline_jitter = 0.0; /* smoothed change in lateness as RFC 3550 does for packets */
+
+/* -r cpu=100ms,disks=1,processes=30 returns the name it did not know or NULL */
+char* collector_periods(char* arg)
+{
+    char* name;
+    char* period;
+    int i;
+
+    for (name = strtok(arg, ","); name != NULL; name = strtok(NULL, ",")) {
+        if ((period = strchr(name, '=')) == NULL)
+            return name;
+        *period++ = 0;
+        for (i = 0; i < COLLECTORS; i++)
+            if (!strcmp(name, collectors[i].name))
+                break;
+        if (i == COLLECTORS || (collectors[i].period = interval_parse(period)) == 0)
+            return name;
+    }
+    return NULL;
+}
+
+void schedule_init()
+{
+    int i;
+
+    schedule_start = nanoschedtime();
+    for (i = 0; i < COLLECTORS; i++) {
+        if (collectors[i].period == 0)
+            collectors[i].period = snapshot_interval;
+        collectors[i].number = 1;
+        collectors[i].due = 0;
+        if (aggregate_interval && collectors[i].enabled && aggregate_interval < collectors[i].period
+            && (i == COLLECTOR_CPU || i == COLLECTOR_DISKS || i == COLLECTOR_NETWORKS)) {
+            collectors[i].aggregate = 1;
+            collectors[i].emit_period = collectors[i].period;
+            collectors[i].emit_number = 1;
+            collectors[i].period = aggregate_interval;
+        }
+    }
+}
+
+void schedule_sleep()
+{
+    long long unsigned now = nanoschedtime();
+    long long unsigned next;
+    long long unsigned due;
+    struct collector* c;
+
+    deadline = 0;
+    for (c = collectors; c < &collectors[COLLECTORS]; c++) {
+        if (!c->enabled)
+            continue;
+        if (c->due && !c->extra) { /* it ran, on to its next deadline */
+            c->number++;
+            if (now >= schedule_start + c->number * c->period) {
+                next = (now - schedule_start) / c->period + 1;
+                deadlines_missed += next - c->number;
+                c->number = next;
+            }
+        }
+        due = schedule_start + c->number * c->period;
+        if (deadline == 0 || due < deadline)
+            deadline = due;
+    }
+    if (pressure_triggers > 0)
+        pressure_fired = pressure_wait(deadline);
+    else
+        nanosleep_until(deadline);
+
+    now = nanoschedtime();
+    if (pressure_fired < 0) { /* a triggered wake up is early on purpose */
+        next = now > deadline ? now - deadline : 0;
+        deadline_jitter += (fabs((double)next - (double)deadline_lateness) - deadline_jitter) / 16.0;
+        deadline_lateness = next;
+        histogram_record(&wake_histogram, deadline_lateness);
+        if (deadline_lateness > deadline_lateness_max)
+            deadline_lateness_max = deadline_lateness;
+    }
+    for (c = collectors; c < &collectors[COLLECTORS]; c++) {
+        c->due = c->enabled && schedule_start + c->number * c->period <= now;
+        c->extra = c->enabled && !c->due && pressure_fired >= 0;
+        c->due |= c->extra;
+        c->emit = c->due;
+        if (c->due && c->aggregate && !c->extra) {
+            c->emit = schedule_start + c->emit_number * c->emit_period <= now;
+            if (c->emit)
+                c->emit_number = (now - schedule_start) / c->emit_period + 1;
+        }
+    }
+}
+
+/* is there anything to output after this wake up */
+int schedule_emits()
+{
+    int i;
+
+    for (i = 0; i < COLLECTORS; i++)
+        if (collectors[i].emit)
+            return 1;
+    return 0;
+}
+
+#define DUE(collector) (collectors[collector].due)
+
+void latency()
+{
+    int i;
+
+    psection("latency");
+    histogram_summary("wake_overshoot", &wake_histogram);
+    histogram_summary("push", &push_histogram);
+    for (i = 0; i < COLLECTORS; i++)
+        if (collectors[i].enabled)
+            histogram_summary(collectors[i].name, &collectors[i].execute);
+    psectionend();
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   real-time mode (-R priority and -A cpus)
+*    the sampler runs SCHED_FIFO, pinned, with its memory locked and prefaulted
+*    and 1 nanosecond timer slack (0 means the default 50 microseconds) so
+*    clock_nanosleep() is not coalesced with other timers. The writer thread
+*    stays SCHED_OTHER so a slow write() can not hold up a CPU at RT priority.
+*    Each step that is refused (not root, no such CPU) is reported on stderr
+*    and precimon carries on without it.
+*/
+int realtime_priority = 0;
+int realtime_affinity = 0;
+cpu_set_t sampler_cpus;
+cpu_set_t writer_cpus;
+
+/* "2", "0-3,8" returns 0 if it is not a CPU list */
+int cpulist_parse(char* list, cpu_set_t* cpus)
+{
+    long first;
+    long last;
+    char* end;
+
+    CPU_ZERO(cpus);
+    for (;;) {
+        first = strtol(list, &end, 10);
+        if (end == list || first < 0 || first >= CPU_SETSIZE)
+            return 0;
+        last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first || last >= CPU_SETSIZE)
+                return 0;
+        }
+        for (; first <= last; first++)
+            CPU_SET(first, cpus);
+        if (*end == 0)
+            return 1;
+        if (*end != ',')
+            return 0;
+        list = end + 1;
+    }
+}
+
+/* -A sampler[:writer] */
+int affinity_parse(char* arg)
+{
+    char* colon = strchr(arg, ':');
+
+    if (colon != NULL)
+        *colon++ = 0;
+    if (!cpulist_parse(arg, &sampler_cpus))
+        return 0;
+    if (colon == NULL)
+        writer_cpus = sampler_cpus;
+    else if (!cpulist_parse(colon, &writer_cpus))
+        return 0;
+    realtime_affinity = 1;
+    return 1;
+}
+
+/* touch the stack the collectors will use so it is mapped before mlockall() */
+void prefault_stack()
+{
+    volatile char stack[512 * 1024];
+
+    memset((char*)stack, 0, sizeof(stack));
+}
+
+void realtime_start()
+{
+    struct sched_param param;
+
+    if (realtime_affinity) {
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &sampler_cpus) == -1)
+            perror("precimon: sched_setaffinity() failed, the sampler is not pinned");
+        if (writer_policy != WRITER_OFF && pthread_setaffinity_np(writer, sizeof(cpu_set_t), &writer_cpus) != 0)
+            fprintf(stderr, "precimon: pthread_setaffinity_np() failed, the writer is not pinned\n");
+    }
+    if (realtime_priority == 0)
+        return;
+
+    if (prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0) == -1)
+        perror("precimon: prctl(PR_SET_TIMERSLACK) failed");
+    prefault_stack();
+    memset(output, 0, output_size);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+        perror("precimon: mlockall() failed, page faults can delay snapshots");
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = realtime_priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) == -1)
+        perror("precimon: sched_setscheduler(SCHED_FIFO) failed, running SCHED_OTHER");
+}
+
+/* what the sampler ended up with, for the timers */
+void realtime_state()
+{
+    struct sched_param param;
+    int policy = sched_getscheduler(0);
+
+    sched_getparam(0, &param);
+    pstring("scheduler", policy == SCHED_FIFO ? "fifo" : policy == SCHED_RR ? "rr" : "other");
+    plong("priority", param.sched_priority);
+    plong("timer_slack", prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0));
+}
+
+void get_time()
+{
+    timer = time(0);
+}
+
+void get_localtime()
+{
+    tim = localtime(&timer);
+    tim->tm_year += 1900; /* read localtime() manual page!! */
+    tim->tm_mon += 1; /* because it is 0 to 11 */
+}
 
 void get_utc()
 {
@@ -500,12 +2252,25 @@ void datetime()
 
 void snapshot_info(long loop)
 {
+    char buffer[256];
+    int i;
 
     FUNCTION_START;
     psection("snapshot_info");
     datetime();
     plong("snapshot_loop", loop);
     pulong("taken_at", nanomonotime());
+    buffer[0] = 0;
+    for (i = 0; i < COLLECTORS; i++) {
+        if (collectors[i].emit) {
+            if (buffer[0] != 0)
+                strcat(buffer, ",");
+            strcat(buffer, collectors[i].name);
+        }
+    }
+    pstring("collectors", buffer);
+    if (pressure_fired >= 0)
+        pstring("triggered_by", pressure_trigger[pressure_fired].spec);
     psectionend();
 }
 
@@ -568,14 +2333,14 @@ struct nfs_stat* nfsp = &nfsa;
 struct nfs_stat* nfsq = &nfsb;
 
 /* files with the NFS data */
-char* nfs_filename = "/proc/net/rpc/nfs";
-char* nfsd_filename = "/proc/net/rpc/nfsd";
 
-/* open flie pointers */
-FILE* nfs_fp = NULL;
-FILE* nfsd_fp = NULL;
+struct procfile nfs_file = { "/proc/net/rpc/nfs", -1 };
+struct procfile nfsd_file = { "/proc/net/rpc/nfsd", -1 };
 
-void nfs_getdata()
+struct source_time nfs_time;
+
+/* returns the seconds since the previous read */
+double nfs_getdata()
 {
     int i;
     int j;
@@ -583,12 +2348,13 @@ void nfs_getdata()
     int lineno;
     char buffer[4096];
     struct nfs_stat* temp;
-    int ret;
+    double elapsed;
 
     /* swap pointers */
     temp = nfsp;
     nfsp = nfsq;
     nfsq = temp;
+    elapsed = source_read(&nfs_time);
 
     /* sample /proc/net/rpc/nfs
     net 0 0 0 0
@@ -597,8 +2363,8 @@ void nfs_getdata()
     proc3 22 0 27364 0 32 828 22 40668 0 1 0 0 0 0 0 0 0 0 1212 6 2 1 0
     proc4 2 5 196
     */
-    if ((nfs_fp = fopen(nfs_filename, "r")) != NULL) {
-        for (lineno = 0; fgets(buffer, 4095, nfs_fp) != NULL; lineno++) {
+    if (procfile_read(&nfs_file) >= 0) {
+        for (lineno = 0; procfile_gets(buffer, 4095, &nfs_file) != NULL; lineno++) {
             buffer[strlen(buffer) - 1] = 0; /* ditch end of line  newline */
             DEBUG printf("get data client line=%d \"%s\"\n", lineno, buffer);
 
@@ -644,10 +2410,6 @@ void nfs_getdata()
                 }
             }
         }
-        ret = fclose(nfs_fp);
-        if (ret != 0)
-            DEBUG printf("fclose(nfs_fp)=%d errno=%d\n", ret, errno);
-
     } else { /* zero all the client counters */
         for (j = 0; j < NFS_V2_NAMES_COUNT; j++) {
             nfsp->v2c[j] = 0;
@@ -677,8 +2439,8 @@ void nfs_getdata()
     proc4 2 0 0
     proc4ops 72 0 0 0 30 0 0 0 0 0 97 4 0 0 0 0 3 0 0 0 0 0 0 125 0 2 0 29 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 2 1 0 0 0 0 0 0 0 0 1 193 0 0 0 0 1 0 0 0 0 0 0 0 0 0 0 0 0 0
     */
-    if ((nfsd_fp = fopen(nfsd_filename, "r")) != NULL) {
-        for (lineno = 0; fgets(buffer, 4095, nfsd_fp) != NULL; lineno++) {
+    if (procfile_read(&nfsd_file) >= 0) {
+        for (lineno = 0; procfile_gets(buffer, 4095, &nfsd_file) != NULL; lineno++) {
             buffer[strlen(buffer) - 1] = 0; /* ditch end of line  newline */
             DEBUG printf("get data server line=%d \"%s\"\n", lineno, buffer);
 
@@ -727,9 +2489,6 @@ void nfs_getdata()
                 }
             }
         }
-        ret = fclose(nfsd_fp);
-        if (ret != 0)
-            DEBUG printf("fclose(nfsd_fp)=%d errno=%d\n", ret, errno);
     } else { /* zero all the server counters */
         for (j = 0; j < NFS_V2_NAMES_COUNT; j++) {
             nfsp->v2s[j] = 0;
@@ -744,6 +2503,7 @@ void nfs_getdata()
             nfsq->v4s[j] = 0;
         }
     }
+    return elapsed;
 }
 
 void nfs_init()
@@ -752,17 +2512,19 @@ void nfs_init()
     memcpy(nfsq, nfsp, (size_t)sizeof(struct nfs_stat));
 }
 
-void nfs(double elapsed)
+void nfs()
 {
     int i;
     long long total;
+    double elapsed;
 
-    nfs_getdata();
+    elapsed = nfs_getdata();
     /* Note: ignoring the first odd stat as this can have a low number and the rest be all zero */
     for (total = 0, i = 1; i < NFS_V2_NAMES_COUNT; i++)
         total += nfsp->v2c[i];
     if (total > 100) {
         psection("NFS2client");
+        pulong("sampled_at", nfs_time.now);
         for (i = 0; i < NFS_V2_NAMES_COUNT; i++) {
             pdouble(nfs_v2_names[i], ((double)(nfsp->v2c[i] - nfsq->v2c[i])) / elapsed);
         }
@@ -772,6 +2534,7 @@ void nfs(double elapsed)
         total += nfsp->v2s[i];
     if (total > 100) {
         psection("NFS2server");
+        pulong("sampled_at", nfs_time.now);
         for (i = 0; i < NFS_V2_NAMES_COUNT; i++) {
             pdouble(nfs_v2_names[i], ((double)(nfsp->v2s[i] - nfsq->v2s[i])) / elapsed);
         }
@@ -781,6 +2544,7 @@ void nfs(double elapsed)
         total += nfsp->v3c[i];
     if (total > 100) {
         psection("NFS3client");
+        pulong("sampled_at", nfs_time.now);
         for (i = 0; i < NFS_V3_NAMES_COUNT; i++) {
             pdouble(nfs_v3_names[i], ((double)(nfsp->v3c[i] - nfsq->v3c[i])) / elapsed);
         }
@@ -790,6 +2554,7 @@ void nfs(double elapsed)
         total += nfsp->v3s[i];
     if (total > 100) {
         psection("NFS3server");
+        pulong("sampled_at", nfs_time.now);
         for (i = 0; i < NFS_V3_NAMES_COUNT; i++) {
             pdouble(nfs_v3_names[i], ((double)(nfsp->v3s[i] - nfsq->v3s[i])) / elapsed);
         }
@@ -799,6 +2564,7 @@ void nfs(double elapsed)
         total += nfsp->v4c[i];
     if (total > 100) {
         psection("NFS4client");
+        pulong("sampled_at", nfs_time.now);
         for (i = 0; i < NFS_V4C_NAMES_COUNT; i++) {
             pdouble(nfs_v4c_names[i], ((double)(nfsp->v4c[i] - nfsq->v4c[i])) / elapsed);
         }
@@ -808,6 +2574,7 @@ void nfs(double elapsed)
         total += nfsp->v4s[i];
     if (total > 100) {
         psection("NFS4server");
+        pulong("sampled_at", nfs_time.now);
         for (i = 0; i < NFS_V4S_NAMES_COUNT; i++) {
             pdouble(nfs_v4s_names[i], ((double)(nfsp->v4s[i] - nfsq->v4s[i])) / elapsed);
         }
@@ -964,6 +2731,8 @@ int gpfs_grab()
     return records;
 }
 
+struct source_time gpfs_time;
+
 void gpfs_init()
 {
     int filesystems = 0;
@@ -1015,26 +2784,30 @@ void gpfs_init()
         close(outfd[0]); /* These are being used by the child */
         close(infd[1]);
         filesystems = gpfs_grab();
+        source_read(&gpfs_time);
         /* copy to the previous records for next time */
         memcpy((void*)&gpfs_io_prev, (void*)&gpfs_io_curr, sizeof(struct gpfs_io));
         memcpy((void*)&gpfs_fs_prev[0], (void*)&gpfs_fs_curr[0], sizeof(struct gpfs_fs) * filesystems);
     }
 }
 
-void gpfs_data(double elapsed)
+void gpfs_data()
 {
     int records;
     int i;
+    double elapsed;
 
     FUNCTION_START;
     if (gpfs_na)
         return;
 
     records = gpfs_grab();
+    elapsed = source_read(&gpfs_time);
 
 #define DELTA_GPFS(xxx) ((double)(gpfs_io_curr.xxx - gpfs_io_prev.xxx) / elapsed)
 
     psection("gpfs_io_total");
+    pulong("sampled_at", gpfs_time.now);
     pstring("node", ip);
     pstring("name", nn);
     plong("rc", gpfs_io_curr.rc); /* status */
@@ -1055,6 +2828,7 @@ void gpfs_data(double elapsed)
 #define DELTA_GPFSFS(xxx) ((double)(gpfs_fs_curr[i].xxx - gpfs_fs_prev[i].xxx) / elapsed)
 
     psection("gpfs_filesystems");
+    pulong("sampled_at", gpfs_time.now);
     for (i = 0; i < records; i++) {
         psub(gpfs_fs_curr[i].fs);
         pstring("node", ip);
@@ -1122,10 +2896,12 @@ void init_lparcfg()
     }
 }
 
-void read_lparcfg(double elapsed)
+void read_lparcfg()
 {
-    static FILE* fp = 0;
+    static struct procfile file = { "/proc/ppc64/lparcfg", -1 };
     static char line[1024];
+    static struct source_time stamp;
+    double elapsed;
     char label[1024];
     char number[1024];
     int i;
@@ -1134,15 +2910,13 @@ void read_lparcfg(double elapsed)
     if (lparcfg_found == 0)
         return;
     FUNCTION_START;
-    if (fp == 0) {
-        if ((fp = fopen("/proc/ppc64/lparcfg", "r")) == NULL) {
-            return;
-        }
-    } else
-        rewind(fp);
+    if (procfile_read(&file) < 0)
+        return;
+    elapsed = source_read(&stamp);
 
     psection("ppc64_lparcfg");
-    while (fgets(line, 1000, fp) != NULL) {
+    pulong("sampled_at", stamp.now);
+    while (procfile_gets(line, 1000, &file) != NULL) {
 
         /* lparcfg version strangely with no = */
         if (!strncmp("lparcfg ", line, 8)) {
@@ -1187,192 +2961,533 @@ void read_lparcfg(double elapsed)
     psectionend();
 }
 
-#define ADD_LABEL(ch) label[labelch++] = ch
-#define ADD_NUM(ch) numstr[numstrch++] = ch
-/*
-read files in format
-name number
-name: number
-name: numer kB
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   meminfo and vmstat
+*    Both files are "name: value" or "name value" lines in an order that is
+*    fixed while the kernel runs, so the names are resolved once into a layout
+*    and each sample only checks the name is still where it was and scans the
+*    number into the fixed array. A name out of place rebuilds the layout.
+*    memory_kinds says which keys are gauges, output as they are, and which are
+*    monotonic counters, output as per second rates. The first "file:key"
+*    pattern to match wins, new kernels just need lines added here.
 */
-void read_data_number(char* statname)
+#define MEMORY_GAUGE 0
+#define MEMORY_COUNTER 1
+
+struct memory_kind {
+    char* pattern; /* fnmatch() glob on "file:key" */
+    int kind;
+} memory_kinds[] = {
+    { "meminfo:*", MEMORY_GAUGE }, /* sizes and amounts */
+    { "vmstat:nr_dirtied", MEMORY_COUNTER }, /* the few nr_ that are events */
+    { "vmstat:nr_written", MEMORY_COUNTER },
+    { "vmstat:nr_foll_pin_*", MEMORY_COUNTER },
+    { "vmstat:nr_vmscan_write", MEMORY_COUNTER },
+    { "vmstat:nr_vmscan_immediate_reclaim", MEMORY_COUNTER },
+    { "vmstat:nr_throttled_written", MEMORY_COUNTER },
+    { "vmstat:nr_tlb_*", MEMORY_COUNTER },
+    { "vmstat:nr_*", MEMORY_GAUGE }, /* pages in use now, thresholds */
+    { "vmstat:workingset_nodes", MEMORY_GAUGE },
+    { "vmstat:*", MEMORY_COUNTER }, /* pg*, pswp*, numa_*, thp_*, compact_*, ... */
+    { NULL, MEMORY_GAUGE } /* anything else */
+};
+
+struct memory_key {
+    char key[64]; /* as in the file */
+    int len;
+    char label[64]; /* for the output: ( becomes _ and ) goes */
+    int kind;
+    long long value;
+    long long previous;
+};
+
+struct memory_file {
+    char* statname;
+    struct procfile file;
+    struct source_time stamp;
+    int keys;
+    int size;
+    struct memory_key* k;
+} memory_files[] = {
+    { "meminfo", { "/proc/meminfo", -1 } },
+    { "vmstat", { "/proc/vmstat", -1 } }
+};
+#define MEMORY_FILES (sizeof(memory_files) / sizeof(struct memory_file))
+
+/* the length of the name at the start of a line */
+static inline int memory_key_len(char* s)
 {
-    FILE* fp = 0;
-    char line[1063];
-    char filename[1024];
-    char label[512];
-    char number[512];
-    int i;
+    char* e = s;
+
+    while (*e != ':' && !SCAN_BLANK(*e) && *e != '\n' && *e != 0)
+        e++;
+    return e - s;
+}
+
+/* the slow path: name, classify and scan every line, the counters start again */
+void memory_layout(struct memory_file* m)
+{
+    struct memory_key* k;
+    char match[128];
+    char* line;
+    char* end;
     int len;
+    int i;
+    int j;
+
+    m->keys = 0;
+    for (line = m->file.buf; *line != 0; line = end + 1) {
+        if ((end = strchr(line, '\n')) == NULL)
+            end = line + strlen(line) - 1;
+        if ((len = memory_key_len(line)) == 0 || len >= (int)sizeof(k->key))
+            continue;
+        if (m->keys == m->size) {
+            m->size = m->size * 2 + 64;
+            m->k = realloc(m->k, sizeof(struct memory_key) * m->size);
+        }
+        k = &m->k[m->keys++];
+        memcpy(k->key, line, len);
+        k->key[len] = 0;
+        k->len = len;
+        for (i = 0, j = 0; i < len; i++) {
+            if (line[i] == '(')
+                k->label[j++] = '_';
+            else if (line[i] != ')')
+                k->label[j++] = line[i];
+        }
+        k->label[j] = 0;
+        snprintf(match, sizeof(match), "%s:%s", m->statname, k->key);
+        for (i = 0; memory_kinds[i].pattern != NULL; i++)
+            if (fnmatch(memory_kinds[i].pattern, match, 0) == 0)
+                break;
+        k->kind = memory_kinds[i].kind;
+        k->value = 0;
+        scan_number(line + len + (line[len] == ':'), &k->value);
+        k->previous = k->value;
+    }
+}
+
+/* read the file into the layout, returns 0 if it could not be read */
+int memory_read(struct memory_file* m)
+{
+    struct memory_key* k;
+    char* line;
+    char* end;
+    int i;
+
+    if (procfile_read(&m->file) < 0)
+        return 0;
+    line = m->file.buf;
+    for (i = 0; i < m->keys && *line != 0; i++) {
+        k = &m->k[i];
+        if (memcmp(line, k->key, k->len) != 0 || memory_key_len(line) != k->len)
+            break;
+        k->previous = k->value;
+        scan_number(line + k->len + (line[k->len] == ':'), &k->value);
+        if ((end = strchr(line + k->len, '\n')) == NULL)
+            break;
+        line = end + 1;
+    }
+    if (i != m->keys || *line != 0) /* first time or a line came, went or moved */
+        memory_layout(m);
+    return 1;
+}
+
+void proc_memory(int print)
+{
+    struct memory_file* m;
+    struct memory_key* k;
+    char label[128];
+    double elapsed;
+    unsigned int f;
+    int i;
 
     FUNCTION_START;
-    sprintf(filename, "/proc/%s", statname);
-    if ((fp = fopen(filename, "r")) == NULL) {
-        sprintf(line, "read_data_number: failed to open file %s", filename);
-        error(line);
-        return;
+    for (f = 0; f < MEMORY_FILES; f++) {
+        m = &memory_files[f];
+        if (!memory_read(m)) {
+            sprintf(label, "proc_memory: failed to open file %s", m->file.filename);
+            error(label);
+            continue;
+        }
+        elapsed = source_read(&m->stamp);
+        if (!print)
+            continue;
+        sprintf(label, "proc_%s", m->statname);
+        psection(label);
+        for (i = 0; i < m->keys; i++) {
+            k = &m->k[i];
+            if (k->kind == MEMORY_COUNTER)
+                pdouble(k->label, elapsed > 0 ? (k->value - k->previous) / elapsed : 0.0);
+            else
+                plong(k->label, k->value);
+        }
+        psectionend();
     }
-    sprintf(label, "proc_%s", statname);
-    psection(label);
-    while (fgets(line, 1000, fp) != NULL) {
-        len = strlen(line);
-        for (i = 0; i < len; i++) {
-            if (line[i] == '(')
-                line[i] = '_';
-            if (line[i] == ')')
-                line[i] = ' ';
-            if (line[i] == ':')
-                line[i] = ' ';
-            if (line[i] == '\n')
-                line[i] = 0;
+}
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   CPU topology rollups
+*    -u picks the per CPU "cpus" section, the per NUMA node "cpu_nodes" and the
+*    per socket "cpu_sockets" sections. On hosts with hundreds of CPUs the
+*    rollups can replace the cpuN subsections. The node and socket of each CPU
+*    come from /sys and are read again when a CPU is seen for the first time
+*    or comes back online. "summary" is the shape across all the CPUs: per
+*    statistic the min, median, p90, max and a 10% bucket histogram, then the
+*    top=K busiest CPUs, so its size does not grow with the number of CPUs.
+*/
+#define CPU_ROLLUP_CPUS 1
+#define CPU_ROLLUP_NODES 2
+#define CPU_ROLLUP_SOCKETS 4
+#define CPU_ROLLUP_SUMMARY 8
+int cpu_rollup = CPU_ROLLUP_CPUS;
+long cpu_summary_top = 8;
+
+#define UTILISATION_STATS 10
+char* utilisation_names[UTILISATION_STATS] = { "user", "nice", "sys", "idle", "iowait",
+    "hardirq", "softirq", "steal", "guest", "guestnice" };
+
+struct rollup {
+    long cpus;
+    double stat[UTILISATION_STATS];
+};
+int* cpu_node = NULL; /* -1 when not known */
+int* cpu_socket = NULL;
+long cpu_topology_cpus = 0;
+struct rollup* node_rollup = NULL;
+long node_rollups = 0;
+struct rollup* socket_rollup = NULL;
+long socket_rollups = 0;
+
+/* -u cpus,nodes,sockets,summary,top=K returns 0 if there is something else in the list */
+int cpu_rollup_parse(char* spec)
+{
+    char* s;
+
+    cpu_rollup = 0;
+    for (s = strtok(spec, ","); s != NULL; s = strtok(NULL, ",")) {
+        if (!strcmp(s, "cpus"))
+            cpu_rollup |= CPU_ROLLUP_CPUS;
+        else if (!strcmp(s, "nodes"))
+            cpu_rollup |= CPU_ROLLUP_NODES;
+        else if (!strcmp(s, "sockets"))
+            cpu_rollup |= CPU_ROLLUP_SOCKETS;
+        else if (!strcmp(s, "summary"))
+            cpu_rollup |= CPU_ROLLUP_SUMMARY;
+        else if (!strncmp(s, "top=", 4) && (cpu_summary_top = atol(&s[4])) >= 0)
+            cpu_rollup |= CPU_ROLLUP_SUMMARY;
+        else
+            return 0;
+    }
+    return cpu_rollup != 0;
+}
+
+/* set map[cpu] = value for each CPU in a sysfs list like "0-3,8" */
+void cpu_topology_list(char* list, int* map, long size, int value)
+{
+    long long first;
+    long long last;
+
+    while ((list = scan_number(list, &first)) != NULL) {
+        last = first;
+        if (*list == '-' && (list = scan_number(list + 1, &last)) == NULL)
+            break;
+        for (; first <= last && first < size; first++)
+            if (first >= 0)
+                map[first] = value;
+        if (*list != ',')
+            break;
+        list++;
+    }
+}
+
+void cpu_topology_read(long cpus)
+{
+    char filename[PATH_MAX];
+    char buf[4096];
+    long long value;
+    DIR* dir;
+    struct dirent* entry;
+    long i;
+    int node;
+
+    cpu_node = realloc(cpu_node, sizeof(int) * cpus);
+    cpu_socket = realloc(cpu_socket, sizeof(int) * cpus);
+    cpu_topology_cpus = cpus;
+    node_rollups = 0;
+    socket_rollups = 0;
+    for (i = 0; i < cpus; i++) {
+        cpu_node[i] = -1;
+        cpu_socket[i] = -1;
+        snprintf(filename, sizeof(filename), "/sys/devices/system/cpu/cpu%ld/topology/physical_package_id", i);
+        if (procfile_once(filename, buf, sizeof(buf)) > 0 && scan_number(buf, &value) != NULL && value >= 0) {
+            cpu_socket[i] = value;
+            if (value >= socket_rollups)
+                socket_rollups = value + 1;
         }
-        sscanf(line, "%s %s", label, number);
-        plong(label, atoll(number));
+    }
+    if ((dir = opendir("/sys/devices/system/node")) != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (strncmp(entry->d_name, "node", 4) || !SCAN_DIGIT(entry->d_name[4]))
+                continue;
+            node = atoi(&entry->d_name[4]);
+            snprintf(filename, sizeof(filename), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+            if (procfile_once(filename, buf, sizeof(buf)) > 0) {
+                cpu_topology_list(buf, cpu_node, cpus, node);
+                if (node >= node_rollups)
+                    node_rollups = node + 1;
+            }
+        }
+        closedir(dir);
+    }
+    node_rollup = realloc(node_rollup, sizeof(struct rollup) * (node_rollups + 1));
+    socket_rollup = realloc(socket_rollup, sizeof(struct rollup) * (socket_rollups + 1));
+}
+
+void cpu_rollup_output(char* section, char* prefix, struct rollup* rollups, long count, unsigned long long sampled_at)
+{
+    char label[64];
+    long i;
+    int j;
+
+    psection(section);
+    pulong("sampled_at", sampled_at);
+    for (i = 0; i < count; i++) {
+        if (rollups[i].cpus == 0)
+            continue;
+        sprintf(label, "%s%ld", prefix, i);
+        psub(label);
+        plong("cpus", rollups[i].cpus);
+        for (j = 0; j < UTILISATION_STATS; j++)
+            pdouble(utilisation_names[j], rollups[i].stat[j] / rollups[i].cpus);
+        psubend();
+    }
+    psectionend();
+}
+
+/* the rates of each CPU this read for the summary */
+struct cpu_rates {
+    int cpuno;
+    double busy; /* all but idle and iowait */
+    double stat[UTILISATION_STATS];
+};
+struct cpu_rates* summary_rates = NULL;
+long summary_cpus = 0;
+long summary_size = 0;
+double* summary_sorted = NULL;
+
+int double_compare(const void* a, const void* b)
+{
+    double x = *(double*)a;
+    double y = *(double*)b;
+
+    return (x > y) - (x < y);
+}
+
+int busy_compare(const void* a, const void* b)
+{
+    double x = ((struct cpu_rates*)a)->busy;
+    double y = ((struct cpu_rates*)b)->busy;
+
+    return (x < y) - (x > y); /* busiest first */
+}
+
+void cpu_summary_add(int cpuno, double* rate)
+{
+    struct cpu_rates* r;
+    int i;
+
+    if (summary_cpus == summary_size) {
+        summary_size = summary_size * 2 + 64;
+        summary_rates = realloc(summary_rates, sizeof(struct cpu_rates) * summary_size);
+        summary_sorted = realloc(summary_sorted, sizeof(double) * summary_size);
+    }
+    r = &summary_rates[summary_cpus++];
+    r->cpuno = cpuno;
+    memcpy(r->stat, rate, sizeof(r->stat));
+    r->busy = 0.0;
+    for (i = 0; i < UTILISATION_STATS; i++)
+        if (i != 3 && i != 4 && i != 8 && i != 9) /* idle, iowait and guest time already counted in user and nice */
+            r->busy += rate[i];
+}
+
+void cpu_summary_output(unsigned long long sampled_at)
+{
+    char label[64];
+    long bucket[10];
+    long i;
+    long k;
+    int j;
+
+    psection("cpu_summary");
+    pulong("sampled_at", sampled_at);
+    plong("cpus", summary_cpus);
+    for (j = 0; j < UTILISATION_STATS && summary_cpus > 0; j++) {
+        memset(bucket, 0, sizeof(bucket));
+        for (i = 0; i < summary_cpus; i++) {
+            summary_sorted[i] = summary_rates[i].stat[j];
+            k = summary_sorted[i] / 10.0;
+            bucket[k < 0 ? 0 : k > 9 ? 9 : k]++;
+        }
+        qsort(summary_sorted, summary_cpus, sizeof(double), double_compare);
+        psub(utilisation_names[j]);
+        pdouble("min", summary_sorted[0]);
+        pdouble("median", summary_sorted[(summary_cpus - 1) / 2]);
+        pdouble("p90", summary_sorted[(summary_cpus * 9 + 9) / 10 - 1]);
+        pdouble("max", summary_sorted[summary_cpus - 1]);
+        for (k = 0; k < 10; k++) {
+            sprintf(label, "cpus_%ld_%ld", k * 10, k * 10 + 10);
+            plong(label, bucket[k]);
+        }
+        psubend();
     }
     psectionend();
-    (void)fclose(fp);
+
+    if (cpu_summary_top == 0)
+        return;
+    qsort(summary_rates, summary_cpus, sizeof(struct cpu_rates), busy_compare);
+    parray("cpu_busiest");
+    for (i = 0; i < summary_cpus && i < cpu_summary_top; i++) {
+        parrayelement();
+        plong("cpu", summary_rates[i].cpuno);
+        pdouble("busy", summary_rates[i].busy);
+        for (j = 0; j < UTILISATION_STATS; j++)
+            pdouble(utilisation_names[j], summary_rates[i].stat[j]);
+        parrayelementend(i == summary_cpus - 1 || i == cpu_summary_top - 1);
+    }
+    parrayend();
 }
+
 /*
 read /proc/stat and unpick
 */
-void proc_stat(double elapsed, int print)
-{
-    long long user;
-    long long nice;
-    long long sys;
-    long long idle;
-    long long iowait;
-    long long hardirq;
-    long long softirq;
-    long long steal;
-    long long guest;
-    long long guestnice;
+void proc_stat(int print)
+{
     int cpu_total = 0;
     int count;
     int cpuno;
     long long value;
+    long long fields[UTILISATION_STATS + 1];
+    double rate[UTILISATION_STATS];
+    char* pos;
+    int i;
     /* Static data */
-    static FILE* fp = 0;
+    static struct procfile file = { "/proc/stat", -1 };
     static char line[8192];
-    static int max_cpuno;
+    static int online_cpus = 1; /* cpuN lines last time, the cpu line is the sum of them */
+    static int topology_stale = 1;
     /* structure to recall previous values */
     struct utilisation {
-        long long user;
-        long long nice;
-        long long sys;
-        long long idle;
-        long long iowait;
-        long long hardirq;
-        long long softirq;
-        long long steal;
-        long long guest;
-        long long guestnice;
+        long long stat[UTILISATION_STATS];
+        long sample; /* read number these are from, a CPU back from offline has no rate */
     };
-#define MAX_LOGICAL_CPU 256
     static long long old_ctxt;
     static long long old_processes;
     static struct utilisation total_cpu;
-    static struct utilisation logical_cpu[MAX_LOGICAL_CPU];
+    static struct utilisation* logical_cpu = NULL; /* grows to the highest CPU number seen */
+    static long logical_cpus = 0;
+    static long sample = 0;
+    static struct source_time stamp;
+    double elapsed;
     char label[512];
 
     FUNCTION_START;
 
-    if (fp == 0) {
-        if ((fp = fopen("/proc/stat", "r")) == NULL) {
-            error("failed to open file /proc/stat");
-            fp = 0;
-            return;
-        }
-    } else
-        rewind(fp);
+    if (procfile_read(&file) < 0) {
+        error("failed to open file /proc/stat");
+        return;
+    }
+    elapsed = source_read(&stamp);
+    sample++;
 
-    while (fgets(line, 1000, fp) != NULL) {
+    while (procfile_gets(line, 1000, &file) != NULL) {
         if (!strncmp(line, "cpu", 3)) {
             if (!strncmp(line, "cpu ", 4)) { /* this is the first line and is the average total CPU stats */
                 cpu_total = 1;
-                count = sscanf(&line[4], /* cpu USER */
-                    "%lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
-                    &user, &nice, &sys, &idle,
-                    &iowait, &hardirq, &softirq,
-                    &steal, &guest, &guestnice);
+                pos = &line[4]; /* cpu USER */
+                count = scan_numbers(&pos, fields, UTILISATION_STATS);
                 if (print) {
-#define DELTA_TOTAL(stat) ((float)(stat - total_cpu.stat) / (float)elapsed / ((float)(max_cpuno + 1.0)))
                     psection("cpu_total");
-                    pdouble("user", DELTA_TOTAL(user)); /* incrementing counter */
-                    pdouble("nice", DELTA_TOTAL(nice)); /* incrementing counter */
-                    pdouble("sys", DELTA_TOTAL(sys)); /* incrementing counter */
-                    pdouble("idle", DELTA_TOTAL(idle)); /* incrementing counter */
-                    /*			pdouble("DEBUG IDLE idle: %lld %lld %lld\n", total_cpu.idle, idle, idle-total_cpu.idle); */
-                    pdouble("iowait", DELTA_TOTAL(iowait)); /* incrementing counter */
-                    pdouble("hardirq", DELTA_TOTAL(hardirq)); /* incrementing counter */
-                    pdouble("softirq", DELTA_TOTAL(softirq)); /* incrementing counter */
-                    pdouble("steal", DELTA_TOTAL(steal)); /* incrementing counter */
-                    pdouble("guest", DELTA_TOTAL(guest)); /* incrementing counter */
-                    pdouble("guestnice", DELTA_TOTAL(guestnice)); /* incrementing counter */
+                    pulong("sampled_at", stamp.now);
+                    for (i = 0; i < UTILISATION_STATS; i++) /* incrementing counters */
+                        pdouble(utilisation_names[i], (double)(fields[i] - total_cpu.stat[i]) / elapsed / online_cpus);
                     psectionend();
                 }
-                total_cpu.user = user;
-                total_cpu.nice = nice;
-                total_cpu.sys = sys;
-                total_cpu.idle = idle;
-                total_cpu.iowait = iowait;
-                total_cpu.hardirq = hardirq;
-                total_cpu.softirq = softirq;
-                total_cpu.steal = steal;
-                total_cpu.guest = guest;
-                total_cpu.guestnice = guestnice;
+                memcpy(total_cpu.stat, fields, sizeof(total_cpu.stat));
                 continue;
             } else {
-                if (cpu_total == 1) /* first cpuNNN line */
-                    if (print)
+                if (cpu_total == 1) { /* first cpuNNN line */
+                    if (print && (cpu_rollup & CPU_ROLLUP_CPUS)) {
                         psection("cpus");
+                        pulong("sampled_at", stamp.now);
+                    }
+                    if (node_rollup != NULL)
+                        memset(node_rollup, 0, sizeof(struct rollup) * node_rollups);
+                    if (socket_rollup != NULL)
+                        memset(socket_rollup, 0, sizeof(struct rollup) * socket_rollups);
+                    summary_cpus = 0;
+                }
                 cpu_total++;
-                count = sscanf(&line[3], /* cpuNNNN USER*/
-                    "%d %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
-                    &cpuno, &user, &nice, &sys, &idle,
-                    &iowait, &hardirq, &softirq,
-                    &steal, &guest, &guestnice);
-                if (cpuno > max_cpuno)
-                    max_cpuno = cpuno;
-                if (cpuno >= MAX_LOGICAL_CPU)
+                pos = &line[3]; /* cpuNNNN USER */
+                count = scan_numbers(&pos, fields, UTILISATION_STATS + 1);
+                cpuno = fields[0];
+                if (count != UTILISATION_STATS + 1 || cpuno < 0)
                     continue;
-                if (print) {
-                    sprintf(label, "cpu%d", cpuno);
-                    psub(label);
-#define DELTA_LOGICAL(stat) ((float)(stat - logical_cpu[cpuno].stat) / (float)elapsed)
-                    pdouble("user", DELTA_LOGICAL(user)); /* counter */
-                    pdouble("nice", DELTA_LOGICAL(nice)); /* counter */
-                    pdouble("sys", DELTA_LOGICAL(sys)); /* counter */
-                    pdouble("idle", DELTA_LOGICAL(idle)); /* counter */
-                    pdouble("iowait", DELTA_LOGICAL(iowait)); /* counter */
-                    pdouble("hardirq", DELTA_LOGICAL(hardirq)); /* counter */
-                    pdouble("softirq", DELTA_LOGICAL(softirq)); /* counter */
-                    pdouble("steal", DELTA_LOGICAL(steal)); /* counter */
-                    pdouble("guest", DELTA_LOGICAL(guest)); /* counter */
-                    pdouble("guestnice", DELTA_LOGICAL(guestnice)); /* counter */
-                    psubend();
+                if (cpuno >= logical_cpus) { /* more CPUs than ever before */
+                    logical_cpu = realloc(logical_cpu, sizeof(struct utilisation) * (cpuno + 1));
+                    memset(&logical_cpu[logical_cpus], 0, sizeof(struct utilisation) * (cpuno + 1 - logical_cpus));
+                    logical_cpus = cpuno + 1;
+                }
+                if (logical_cpu[cpuno].sample != sample - 1) { /* new or back online, no rate until the next time */
+                    topology_stale = 1;
+                } else {
+                    for (i = 0; i < UTILISATION_STATS; i++) /* counters */
+                        rate[i] = (double)(fields[i + 1] - logical_cpu[cpuno].stat[i]) / elapsed;
+                    if (print && (cpu_rollup & CPU_ROLLUP_CPUS)) {
+                        sprintf(label, "cpu%d", cpuno);
+                        psub(label);
+                        for (i = 0; i < UTILISATION_STATS; i++)
+                            pdouble(utilisation_names[i], rate[i]);
+                        psubend();
+                    }
+                    if (cpu_rollup & CPU_ROLLUP_SUMMARY)
+                        cpu_summary_add(cpuno, rate);
+                    if (cpuno < cpu_topology_cpus && cpu_node[cpuno] >= 0) {
+                        node_rollup[cpu_node[cpuno]].cpus++;
+                        for (i = 0; i < UTILISATION_STATS; i++)
+                            node_rollup[cpu_node[cpuno]].stat[i] += rate[i];
+                    }
+                    if (cpuno < cpu_topology_cpus && cpu_socket[cpuno] >= 0) {
+                        socket_rollup[cpu_socket[cpuno]].cpus++;
+                        for (i = 0; i < UTILISATION_STATS; i++)
+                            socket_rollup[cpu_socket[cpuno]].stat[i] += rate[i];
+                    }
                 }
-                logical_cpu[cpuno].user = user;
-                logical_cpu[cpuno].nice = nice;
-                logical_cpu[cpuno].sys = sys;
-                logical_cpu[cpuno].idle = idle;
-                logical_cpu[cpuno].iowait = iowait;
-                logical_cpu[cpuno].hardirq = hardirq;
-                logical_cpu[cpuno].softirq = softirq;
-                logical_cpu[cpuno].steal = steal;
-                logical_cpu[cpuno].guest = guest;
-                logical_cpu[cpuno].guestnice = guestnice;
+                memcpy(logical_cpu[cpuno].stat, &fields[1], sizeof(logical_cpu[cpuno].stat));
+                logical_cpu[cpuno].sample = sample;
                 continue;
             }
         }
-        if (!strncmp(line, "ctxt", 4)) {
-            if (print)
-                psectionend(); /* rather aassumes ctxt is the first non "cpu" line */
+        if (!strncmp(line, "ctxt", 4)) { /* rather assumes ctxt is the first non "cpu" line */
+            if (print && (cpu_rollup & CPU_ROLLUP_CPUS))
+                psectionend();
+            if (print && (cpu_rollup & CPU_ROLLUP_NODES))
+                cpu_rollup_output("cpu_nodes", "node", node_rollup, node_rollups, stamp.now);
+            if (print && (cpu_rollup & CPU_ROLLUP_SOCKETS))
+                cpu_rollup_output("cpu_sockets", "socket", socket_rollup, socket_rollups, stamp.now);
+            if (print && (cpu_rollup & CPU_ROLLUP_SUMMARY))
+                cpu_summary_output(stamp.now);
+            if (cpu_total > 1)
+                online_cpus = cpu_total - 1;
+            if (topology_stale && (cpu_rollup & (CPU_ROLLUP_NODES | CPU_ROLLUP_SOCKETS))) {
+                cpu_topology_read(logical_cpus);
+                topology_stale = 0;
+            }
             value = 0;
-            count = sscanf(&line[5], "%lld", &value); /* counter */
+            count = scan_number(&line[5], &value) != NULL; /* counter */
             if (count == 1) {
                 if (print) {
                     psection("stat_counters");
+                    pulong("sampled_at", stamp.now);
                     pdouble("ctxt", ((double)(value - old_ctxt) / elapsed));
                 }
                 old_ctxt = value;
@@ -1381,14 +3496,14 @@ void proc_stat(double elapsed, int print)
         }
         if (!strncmp(line, "btime", 5)) {
             value = 0;
-            count = sscanf(&line[6], "%lld", &value); /* seconds since boot */
+            count = scan_number(&line[6], &value) != NULL; /* seconds since boot */
             if (print)
                 plong("btime", value);
             continue;
         }
         if (!strncmp(line, "processes", 9)) {
             value = 0;
-            count = sscanf(&line[10], "%lld", &value); /* counter  actually forks */
+            count = scan_number(&line[10], &value) != NULL; /* counter  actually forks */
             if (print)
                 pdouble("processes_forks", ((double)(value - old_processes) / elapsed));
             old_processes = value;
@@ -1396,14 +3511,14 @@ void proc_stat(double elapsed, int print)
         }
         if (!strncmp(line, "procs_running", 13)) {
             value = 0;
-            count = sscanf(&line[14], "%lld", &value);
+            count = scan_number(&line[14], &value) != NULL;
             if (print)
                 plong("procs_running", value);
             continue;
         }
         if (!strncmp(line, "procs_blocked", 13)) {
             value = 0;
-            count = sscanf(&line[14], "%lld", &value);
+            count = scan_number(&line[14], &value) != NULL;
             if (print) {
                 plong("procs_blocked", value);
                 psectionend(); /* rather assumes "blocked" is the last line */
@@ -1414,108 +3529,423 @@ void proc_stat(double elapsed, int print)
     }
 }
 
-void proc_diskstats(double elapsed, int print)
-{
-    struct diskinfo {
-        long dk_major;
-        long dk_minor;
-        char dk_name[128];
-        long long dk_reads;
-        long long dk_rmerge;
-        long long dk_rkb;
-        long long dk_rmsec;
-        long long dk_writes;
-        long long dk_wmerge;
-        long long dk_wkb;
-        long long dk_wmsec;
-        long long dk_inflight;
-        long long dk_time;
-        long long dk_backlog;
-        long long dk_xfers;
-        long long dk_bsize;
-    };
-    static struct diskinfo current;
-    static struct diskinfo* previous;
-    static FILE* fp = 0;
-    char buf[1024];
-    int dk_stats;
-    /* popen variables */
-    FILE* pop;
-    static long disks;
-    char tmpstr[1024 + 1];
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   interrupts (-Q count)
+*    /proc/interrupts and /proc/softirqs are a matrix of counters with a row per
+*    IRQ or softirq type and a column per online CPU. The kernel prints them as
+*    unsigned int so the last values are kept as uint32_t, a delta of two
+*    uint32_t is right across a wrap. Only the per CPU totals and the count
+*    hottest IRQ/CPU cells are output so a 256 CPU host with 1000 IRQs is still
+*    a few lines. A row whose label changed or a change in the online CPUs has
+*    no rate until the next read.
+*/
+long irq_top = 10;
+
+#define IRQ_NAME 16
+
+struct irq_hot {
+    long row;
+    long col;
+    double rate;
+};
+
+struct irq_matrix {
+    struct procfile file;
+    char* section;
+    char* hottest; /* the array of the hottest cells */
+    char* row_name; /* "irq" or "softirq" */
+    int descriptions; /* /proc/interrupts has the chip and device after the counters */
+    long rows;
+    long rows_size;
+    long cols;
+    long cols_size;
+    int* cpus; /* CPU number of each column */
+    char (*names)[IRQ_NAME];
+    char** description;
+    uint32_t* counts; /* rows_size x cols_size from the last read */
+    double* cpu_rates;
+    struct irq_hot* hot;
+    long hot_count;
+    struct source_time stamp;
+};
+
+struct irq_matrix irq_interrupts = { { "/proc/interrupts", -1 }, "interrupts", "interrupts_hottest", "irq", 1 };
+struct irq_matrix irq_softirqs = { { "/proc/softirqs", -1 }, "softirqs", "softirqs_hottest", "softirq", 0 };
+
+/* keep the irq_top hottest cells in rate order */
+void irq_hot_add(struct irq_matrix* m, long row, long col, double rate)
+{
     long i;
-    long j;
+
+    if (m->hot_count == irq_top && rate <= m->hot[irq_top - 1].rate)
+        return;
+    if (m->hot_count < irq_top)
+        m->hot_count++;
+    for (i = m->hot_count - 1; i > 0 && m->hot[i - 1].rate < rate; i--)
+        m->hot[i] = m->hot[i - 1];
+    m->hot[i].row = row;
+    m->hot[i].col = col;
+    m->hot[i].rate = rate;
+}
+
+void irq_matrix_read(struct irq_matrix* m, int print)
+{
+    char* line;
+    char* end;
+    char* pos;
+    char* next;
+    char* label;
+    char description[256];
+    long long value;
+    long cols;
+    long row;
+    long col;
     long len;
+    int valid;
+    int row_valid;
+    uint32_t count;
+    double rate;
+    double total = 0.0;
+    double elapsed;
+    char cpu_label[32];
 
-    FUNCTION_START;
-    if (fp == NULL) {
-        /* Just count the number of disks */
-        pop = popen("lsblk --nodeps --output NAME,TYPE --raw 2>/dev/null", "r");
-        if (pop != NULL) {
-            /* throw away the headerline */
-            tmpstr[0] = 0;
-            if (fgets(tmpstr, 127, pop) != NULL) {
-                for (disks = 0;; disks++) {
-                    tmpstr[0] = 0;
-                    if (fgets(tmpstr, 127, pop) == NULL)
-                        break;
-                }
+    if (procfile_read(&m->file) < 0)
+        return;
+    elapsed = source_read(&m->stamp);
+    valid = m->stamp.previous != 0;
+
+    /* the header "CPU0 CPU1 ..." gives the columns */
+    line = m->file.buf;
+    if ((end = strchr(line, '\n')) == NULL)
+        return;
+    *end = 0;
+    for (pos = line, cols = 0; (pos = strstr(pos, "CPU")) != NULL && scan_number(pos + 3, &value) != NULL; pos += 3, cols++) {
+        if (cols == m->cols_size) {
+            m->cols_size = m->cols_size * 2 + 64;
+            m->cpus = realloc(m->cpus, sizeof(int) * m->cols_size);
+            m->cpu_rates = realloc(m->cpu_rates, sizeof(double) * m->cols_size);
+            m->rows_size = 0; /* the counts are laid out by cols_size so start them again */
+            valid = 0;
+        }
+        if (cols >= m->cols || m->cpus[cols] != value)
+            valid = 0;
+        m->cpus[cols] = value;
+    }
+    if (cols != m->cols)
+        valid = 0;
+    m->cols = cols;
+    memset(m->cpu_rates, 0, sizeof(double) * m->cols_size);
+    if (irq_top > 0 && m->hot == NULL)
+        m->hot = malloc(sizeof(struct irq_hot) * irq_top);
+    m->hot_count = 0;
+
+    for (row = 0, line = end + 1; *line != 0; line = end + 1, row++) {
+        if ((end = strchr(line, '\n')) == NULL)
+            end = line + strlen(line) - 1; /* the last line without a newline */
+        else
+            *end = 0;
+        while (SCAN_BLANK(*line))
+            line++;
+        label = line;
+        if ((pos = strchr(line, ':')) == NULL)
+            break;
+        *pos++ = 0;
+        if (row == m->rows_size) {
+            m->rows_size = m->rows_size * 2 + 64;
+            m->names = realloc(m->names, IRQ_NAME * m->rows_size);
+            m->description = realloc(m->description, sizeof(char*) * m->rows_size);
+            m->counts = realloc(m->counts, sizeof(uint32_t) * m->rows_size * m->cols_size);
+            memset(&m->names[row], 0, IRQ_NAME * (m->rows_size - row));
+            memset(&m->description[row], 0, sizeof(char*) * (m->rows_size - row));
+        }
+        row_valid = valid && row < m->rows && !strncmp(m->names[row], label, IRQ_NAME - 1);
+        if (!row_valid) {
+            strncpy(m->names[row], label, IRQ_NAME - 1);
+            m->names[row][IRQ_NAME - 1] = 0;
+        }
+        for (col = 0; col < cols && (next = scan_number(pos, &value)) != NULL; col++) {
+            pos = next;
+            count = value;
+            if (row_valid) {
+                rate = (uint32_t)(count - m->counts[row * m->cols_size + col]) / elapsed;
+                m->cpu_rates[col] += rate;
+                total += rate;
+                if (irq_top > 0 && rate > 0.0)
+                    irq_hot_add(m, row, col, rate);
             }
-            pclose(pop);
-        } else
-            disks = 0;
-        /*printf("DEBUG %ld disks\n",disks); */
-        previous = malloc(sizeof(struct diskinfo) * disks);
-
-        pop = popen("lsblk --nodeps --output NAME,TYPE --raw 2>/dev/null", "r");
-        if (pop != NULL) {
-            /* throw away the headerline */
-            if (fgets(tmpstr, 70, pop) != NULL) {
-                for (i = 0; i < disks; i++) {
-                    tmpstr[0] = 0;
-                    if (fgets(tmpstr, 70, pop) == NULL)
-                        break;
-                    tmpstr[strlen(tmpstr)] = 0; /* remove NL char */
-                    len = strlen(tmpstr);
-                    for (j = 0; j < len; j++)
-                        if (tmpstr[j] == ' ')
-                            tmpstr[j] = 0;
-                    strcpy(previous[i].dk_name, tmpstr);
-                }
+            m->counts[row * m->cols_size + col] = count;
+        }
+        if (m->descriptions) { /* the rest of the line with the blanks squeezed */
+            for (len = 0; *pos != 0 && len < (long)sizeof(description) - 1; pos++)
+                if (!SCAN_BLANK(*pos) || (len > 0 && description[len - 1] != ' '))
+                    description[len++] = SCAN_BLANK(*pos) ? ' ' : *pos;
+            while (len > 0 && description[len - 1] == ' ')
+                len--;
+            description[len] = 0;
+            if (m->description[row] == NULL || strcmp(m->description[row], description)) {
+                free(m->description[row]);
+                m->description[row] = strdup(description);
             }
-            pclose(pop);
-        } else
-            disks = 0;
+        }
+    }
+    m->rows = row;
 
-        if ((fp = fopen("/proc/diskstats", "r")) == NULL) {
-            error("failed to open - /proc/diskstats");
-            return;
+    if (!print || !valid)
+        return;
+    psection(m->section);
+    pulong("sampled_at", m->stamp.now);
+    pdouble("total", total);
+    for (col = 0; col < cols; col++) {
+        sprintf(cpu_label, "cpu%d", m->cpus[col]);
+        pdouble(cpu_label, m->cpu_rates[col]);
+    }
+    psectionend();
+    if (irq_top == 0)
+        return;
+    parray(m->hottest);
+    for (col = 0; col < m->hot_count; col++) {
+        parrayelement();
+        pstring(m->row_name, m->names[m->hot[col].row]);
+        if (m->descriptions && m->description[m->hot[col].row] != NULL && m->description[m->hot[col].row][0] != 0)
+            pstring("description", m->description[m->hot[col].row]);
+        plong("cpu", m->cpus[m->hot[col].col]);
+        pdouble("rate", m->hot[col].rate);
+        parrayelementend(col == m->hot_count - 1);
+    }
+    parrayend();
+}
+
+void interrupts(int print)
+{
+    FUNCTION_START;
+    irq_matrix_read(&irq_interrupts, print);
+    irq_matrix_read(&irq_softirqs, print);
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   disks
+*    The whole disks are the entries of /sys/block and anything else in
+*    /proc/diskstats is a partition. Each line is found by its major:minor in an
+*    open addressing hash, a device seen for the first time is added (its rates
+*    start at the next read) and one that has gone is dropped, so hotplugged
+*    disks, new dm and NVMe namespaces are followed. /sys/block is only read
+*    again when a new device shows up. Like lsblk, ram disks and devices that
+*    have never done any I/O (unused loop devices) are left out.
+*    -b picks the types: partitions, loop and dm, or noloop and nodm to drop them
+*    (default the whole disks with loop and dm).
+*/
+#define DISK_PARTITIONS 1
+#define DISK_LOOP 2
+#define DISK_DM 4
+int disk_types = DISK_LOOP | DISK_DM;
+
+/* -b partitions,noloop,nodm returns 0 if there is something else in the list */
+int disk_types_parse(char* spec)
+{
+    char* s;
+    int type;
+
+    for (s = strtok(spec, ","); s != NULL; s = strtok(NULL, ",")) {
+        type = 0;
+        if (!strcmp(s, "partitions") || !strcmp(s, "nopartitions"))
+            type = DISK_PARTITIONS;
+        else if (!strcmp(s, "loop") || !strcmp(s, "noloop"))
+            type = DISK_LOOP;
+        else if (!strcmp(s, "dm") || !strcmp(s, "nodm"))
+            type = DISK_DM;
+        else
+            return 0;
+        if (!strncmp(s, "no", 2))
+            disk_types &= ~type;
+        else
+            disk_types |= type;
+    }
+    return 1;
+}
+
+struct diskinfo {
+    long dk_major;
+    long dk_minor;
+    char dk_name[128];
+    long long dk_reads;
+    long long dk_rmerge;
+    long long dk_rkb;
+    long long dk_rmsec;
+    long long dk_writes;
+    long long dk_wmerge;
+    long long dk_wkb;
+    long long dk_wmsec;
+    long long dk_inflight;
+    long long dk_time;
+    long long dk_backlog;
+    long long dk_discards; /* 4.18 */
+    long long dk_dmerge;
+    long long dk_dkb;
+    long long dk_dmsec;
+    long long dk_flushes; /* 5.5 */
+    long long dk_fmsec;
+    int dk_fields; /* on the line, 14, 18 or 20 */
+    long long dk_xfers;
+    long long dk_bsize;
+    int dk_excluded; /* by -b, kept so it is not looked up again */
+    long dk_sample; /* the read it was last in */
+};
+
+struct diskinfo* disk = NULL;
+long disks = 0;
+long disks_size = 0;
+long* disk_hash = NULL; /* index + 1 into disk[] or 0 for an empty slot */
+long disk_hash_size = 0; /* a power of 2, at least twice disks */
+unsigned long* whole_disks = NULL; /* makedev() of the /sys/block entries */
+long whole_disks_count = 0;
+
+#define DISK_HASH(major, minor) ((((unsigned long)(major) << 20) ^ (unsigned long)(minor)) * 0x9E3779B97F4A7C15ULL >> 40)
+
+long disk_find(long major, long minor)
+{
+    long slot;
+    long i;
+
+    if (disk_hash_size == 0)
+        return -1;
+    for (slot = DISK_HASH(major, minor) & (disk_hash_size - 1); disk_hash[slot] != 0; slot = (slot + 1) & (disk_hash_size - 1)) {
+        i = disk_hash[slot] - 1;
+        if (disk[i].dk_major == major && disk[i].dk_minor == minor)
+            return i;
+    }
+    return -1;
+}
+
+void disk_hash_rebuild()
+{
+    long slot;
+    long i;
+
+    if (disk_hash_size < disks * 2) {
+        while (disk_hash_size < disks * 2)
+            disk_hash_size = disk_hash_size ? disk_hash_size * 2 : 64;
+        disk_hash = realloc(disk_hash, sizeof(long) * disk_hash_size);
+    }
+    memset(disk_hash, 0, sizeof(long) * disk_hash_size);
+    for (i = 0; i < disks; i++) {
+        for (slot = DISK_HASH(disk[i].dk_major, disk[i].dk_minor) & (disk_hash_size - 1); disk_hash[slot] != 0;)
+            slot = (slot + 1) & (disk_hash_size - 1);
+        disk_hash[slot] = i + 1;
+    }
+}
+
+/* the major:minor of each /sys/block entry */
+void whole_disks_read()
+{
+    char filename[PATH_MAX];
+    char buf[64];
+    DIR* dir;
+    struct dirent* entry;
+    long long major;
+    long long minor;
+    char* pos;
+    long size = 0;
+
+    whole_disks_count = 0;
+    if ((dir = opendir("/sys/block")) == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(filename, sizeof(filename), "/sys/block/%s/dev", entry->d_name);
+        if (procfile_once(filename, buf, sizeof(buf)) <= 0)
+            continue;
+        if ((pos = scan_number(buf, &major)) == NULL || *pos != ':' || scan_number(pos + 1, &minor) == NULL)
+            continue;
+        if (whole_disks_count == size) {
+            size = size * 2 + 64;
+            whole_disks = realloc(whole_disks, sizeof(unsigned long) * size);
         }
-    } else
-        rewind(fp);
+        whole_disks[whole_disks_count++] = makedev(major, minor);
+    }
+    closedir(dir);
+}
+
+/* a device not seen before, -b decides if it is output */
+int disk_excluded(struct diskinfo* d)
+{
+    static long rescanned = -1;
+    long i;
+
+    if (d->dk_major == 1) /* ram disks */
+        return 1;
+    if (d->dk_major == 7)
+        return !(disk_types & DISK_LOOP);
+    if (!strncmp(d->dk_name, "dm-", 3))
+        return !(disk_types & DISK_DM);
+    if (rescanned != d->dk_sample) { /* once per read there is something new */
+        whole_disks_read();
+        rescanned = d->dk_sample;
+    }
+    for (i = 0; i < whole_disks_count; i++)
+        if (whole_disks[i] == makedev(d->dk_major, d->dk_minor))
+            return 0;
+    return !(disk_types & DISK_PARTITIONS);
+}
+
+void proc_diskstats(int print)
+{
+    static struct diskinfo current;
+    struct diskinfo* previous;
+    static struct procfile file = { "/proc/diskstats", -1 };
+    static struct source_time stamp;
+    static long sample = 0;
+    double elapsed;
+    char buf[1024];
+    char* pos;
+    long long fields[19];
+    int dk_stats;
+    long i;
+    long j;
+    double ios;
 
-    if (print)
+    FUNCTION_START;
+    if (procfile_read(&file) < 0) {
+        error("failed to open - /proc/diskstats");
+        return;
+    }
+    elapsed = source_read(&stamp);
+    sample++;
+
+    if (print) {
         psection("disks");
-    while (fgets(buf, 1024, fp) != NULL) {
+        pulong("sampled_at", stamp.now);
+    }
+    while (procfile_gets(buf, 1024, &file) != NULL) {
         buf[strlen(buf) - 1] = 0; /* remove newline */
         /*printf("DISKSTATS: \"%s\"", buf);*/
         /* zero the data ready for reading */
         bzero(&current, sizeof(struct diskinfo));
-        dk_stats = sscanf(&buf[0], "%ld %ld %s %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
-            &current.dk_major,
-            &current.dk_minor,
-            &current.dk_name[0],
-            &current.dk_reads,
-            &current.dk_rmerge,
-            &current.dk_rkb,
-            &current.dk_rmsec,
-            &current.dk_writes,
-            &current.dk_wmerge,
-            &current.dk_wkb,
-            &current.dk_wmsec,
-            &current.dk_inflight,
-            &current.dk_time,
-            &current.dk_backlog);
+        bzero(fields, sizeof(fields));
+        pos = buf;
+        dk_stats = scan_numbers(&pos, fields, 2);
+        if (dk_stats == 2 && scan_word(&pos, current.dk_name, sizeof(current.dk_name)))
+            dk_stats += 1 + scan_numbers(&pos, &fields[2], 17);
+        current.dk_major = fields[0];
+        current.dk_minor = fields[1];
+        current.dk_reads = fields[2];
+        current.dk_rmerge = fields[3];
+        current.dk_rkb = fields[4];
+        current.dk_rmsec = fields[5];
+        current.dk_writes = fields[6];
+        current.dk_wmerge = fields[7];
+        current.dk_wkb = fields[8];
+        current.dk_wmsec = fields[9];
+        current.dk_inflight = fields[10];
+        current.dk_time = fields[11];
+        current.dk_backlog = fields[12];
+        current.dk_discards = fields[13];
+        current.dk_dmerge = fields[14];
+        current.dk_dkb = fields[15] / 2;
+        current.dk_dmsec = fields[16];
+        current.dk_flushes = fields[17];
+        current.dk_fmsec = fields[18];
+        current.dk_fields = dk_stats;
 
         if (dk_stats == 7) { /* shuffle the data around due to missing columns for partitions */
             current.dk_wkb = current.dk_rmsec;
@@ -1523,8 +3953,8 @@ void proc_diskstats(double elapsed, int print)
             current.dk_rkb = current.dk_rmerge;
             current.dk_rmsec = 0;
             current.dk_rmerge = 0;
-        } else if (dk_stats != 14)
-            fprintf(stderr, "disk sscanf wanted 14 but returned=%d line=%s\n", dk_stats, buf);
+        } else if (dk_stats != 14 && dk_stats != 18 && dk_stats != 20)
+            fprintf(stderr, "disk scan wanted 14, 18 or 20 but returned=%d line=%s\n", dk_stats, buf);
 
         current.dk_rkb /= 2; /* sectors = 512 bytes */
         current.dk_wkb /= 2;
@@ -1536,164 +3966,998 @@ void proc_diskstats(double elapsed, int print)
 
         current.dk_time /= 10.0; /* in milli-seconds to make it upto 100%, 1000/100 = 10 */
 
-        for (i = 0; i < disks; i++) {
-            /*printf("DEBUG disks new %s old %s\n", current.dk_name,previous[i].dk_name);*/
-            if (!strcmp(current.dk_name, previous[i].dk_name)) {
-                if (print) {
-                    psub(current.dk_name);
-                    pdouble("reads", (current.dk_reads - previous[i].dk_reads) / elapsed);
-                    /*printf("DEBUG  reads: %lld %lld %.2f,\n",    current.dk_reads, previous[i].dk_reads,  elapsed); */
-                    pdouble("rmerge", (current.dk_rmerge - previous[i].dk_rmerge) / elapsed);
-                    pdouble("rkb", (current.dk_rkb - previous[i].dk_rkb) / elapsed);
-                    pdouble("rmsec", (current.dk_rmsec - previous[i].dk_rmsec) / elapsed);
-
-                    pdouble("writes", (current.dk_writes - previous[i].dk_writes) / elapsed);
-                    pdouble("wmerge", (current.dk_wmerge - previous[i].dk_wmerge) / elapsed);
-                    pdouble("wkb", (current.dk_wkb - previous[i].dk_wkb) / elapsed);
-                    pdouble("wmsec", (current.dk_wmsec - previous[i].dk_wmsec) / elapsed);
-
-                    plong("inflight", current.dk_inflight); /* this is current count & not a incremented number */
-                    pdouble("busy", (current.dk_time - previous[i].dk_time) / elapsed);
-                    pdouble("backlog", (current.dk_backlog - previous[i].dk_backlog) / elapsed);
-                    pdouble("xfers", (current.dk_xfers - previous[i].dk_xfers) / elapsed);
-                    plong("bsize", current.dk_bsize); /* this is fixed number & not a incremented number */
-                    psubend();
+        current.dk_sample = sample;
+        if ((i = disk_find(current.dk_major, current.dk_minor)) < 0 || strcmp(disk[i].dk_name, current.dk_name)) {
+            if (current.dk_reads + current.dk_writes == 0)
+                continue; /* never used, like an unattached loop device */
+            if (i < 0) { /* a new device, its rates start next time */
+                if (disks == disks_size) {
+                    disks_size = disks_size * 2 + 16;
+                    disk = realloc(disk, sizeof(struct diskinfo) * disks_size);
                 }
-                memcpy(&previous[i], &current, sizeof(struct diskinfo));
-                break; /* once found stop searching */
+                i = disks++;
+                memcpy(&disk[i], &current, sizeof(struct diskinfo));
+                disk_hash_rebuild();
+            } else
+                memcpy(&disk[i], &current, sizeof(struct diskinfo));
+            disk[i].dk_excluded = disk_excluded(&disk[i]);
+            continue;
+        }
+        previous = &disk[i];
+        current.dk_excluded = previous->dk_excluded;
+        if (print && !previous->dk_excluded) {
+            psub(current.dk_name);
+            pdouble("reads", (current.dk_reads - previous->dk_reads) / elapsed);
+            pdouble("rmerge", (current.dk_rmerge - previous->dk_rmerge) / elapsed);
+            pdouble("rkb", (current.dk_rkb - previous->dk_rkb) / elapsed);
+            pdouble("rmsec", (current.dk_rmsec - previous->dk_rmsec) / elapsed);
+
+            pdouble("writes", (current.dk_writes - previous->dk_writes) / elapsed);
+            pdouble("wmerge", (current.dk_wmerge - previous->dk_wmerge) / elapsed);
+            pdouble("wkb", (current.dk_wkb - previous->dk_wkb) / elapsed);
+            pdouble("wmsec", (current.dk_wmsec - previous->dk_wmsec) / elapsed);
+
+            plong("inflight", current.dk_inflight); /* this is current count & not a incremented number */
+            pdouble("busy", (current.dk_time - previous->dk_time) / elapsed);
+            pdouble("backlog", (current.dk_backlog - previous->dk_backlog) / elapsed);
+            pdouble("xfers", (current.dk_xfers - previous->dk_xfers) / elapsed);
+            plong("bsize", current.dk_bsize); /* this is fixed number & not a incremented number */
+            if (current.dk_fields >= 18) {
+                pdouble("discards", (current.dk_discards - previous->dk_discards) / elapsed);
+                pdouble("dmerge", (current.dk_dmerge - previous->dk_dmerge) / elapsed);
+                pdouble("dkb", (current.dk_dkb - previous->dk_dkb) / elapsed);
+                pdouble("dmsec", (current.dk_dmsec - previous->dk_dmsec) / elapsed);
             }
+            if (current.dk_fields >= 20) {
+                pdouble("flushes", (current.dk_flushes - previous->dk_flushes) / elapsed);
+                pdouble("fmsec", (current.dk_fmsec - previous->dk_fmsec) / elapsed);
+            }
+
+            /* iostat -x over the interval: milliseconds per I/O, requests queued, KB per request */
+#define DISK_DELTA(member) ((double)(current.member - previous->member))
+#define DISK_RATIO(a, b) (DISK_DELTA(b) > 0 ? DISK_DELTA(a) / DISK_DELTA(b) : 0.0)
+            ios = DISK_DELTA(dk_reads) + DISK_DELTA(dk_writes) + DISK_DELTA(dk_discards);
+            pdouble("await", ios > 0 ? (DISK_DELTA(dk_rmsec) + DISK_DELTA(dk_wmsec) + DISK_DELTA(dk_dmsec)) / ios : 0.0);
+            pdouble("r_await", DISK_RATIO(dk_rmsec, dk_reads));
+            pdouble("w_await", DISK_RATIO(dk_wmsec, dk_writes));
+            if (current.dk_fields >= 18)
+                pdouble("d_await", DISK_RATIO(dk_dmsec, dk_discards));
+            if (current.dk_fields >= 20)
+                pdouble("f_await", DISK_RATIO(dk_fmsec, dk_flushes));
+            pdouble("aqu_sz", DISK_DELTA(dk_backlog) / (elapsed * 1000.0));
+            pdouble("areq_kb", ios > 0 ? (DISK_DELTA(dk_rkb) + DISK_DELTA(dk_wkb) + DISK_DELTA(dk_dkb)) / ios : 0.0);
+            pdouble("rareq_kb", DISK_RATIO(dk_rkb, dk_reads));
+            pdouble("wareq_kb", DISK_RATIO(dk_wkb, dk_writes));
+            psubend();
         }
+        memcpy(previous, &current, sizeof(struct diskinfo));
     }
     if (print)
         psectionend();
+
+    /* drop the devices that have gone */
+    for (i = 0, j = 0; i < disks; i++)
+        if (disk[i].dk_sample == sample)
+            disk[j++] = disk[i];
+    if (j != disks) {
+        disks = j;
+        disk_hash_rebuild();
+    }
 }
 
-void strip_spaces(char* s)
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   networks
+*    Interfaces are found by name in an open addressing hash and dropped once
+*    they are no longer listed, so hosts that churn thousands of veth devices
+*    do not slow down or grow. -o has the rules, checked in order the first
+*    time an interface is seen, the first match wins:
+*      glob or +glob     output it
+*      -glob             leave it out
+*      glob=name         add it into the one entry called name
+*    A pattern starting ~ is a regular expression instead of a glob. If there
+*    are + rules anything they do not match is left out. The rules are
+*    compiled once at start up.
+*    The counters come from one RTM_GETLINK netlink dump of the binary
+*    rtnl_link_stats64 of every link, which also has the counters that
+*    /proc/net/dev folds together or leaves out. If netlink fails precimon falls
+*    back to /proc/net/dev and its 13 counters for good.
+*/
+#define NET_PROC_STATS 13 /* /proc/net/dev has the first ones */
+#define NET_STATS 22
+char* net_names[NET_STATS] = { "ibytes", "ipackets", "ierrs", "idrop", "ififo", "iframe",
+    "obytes", "opackets", "oerrs", "odrop", "ofifo", "ocolls", "ocarrier",
+    "imulticast", "imissed", "inohandler", "ilength", "iover", "icrc",
+    "oaborted", "oheartbeat", "owindow" };
+int net_stats = NET_PROC_STATS; /* in use by the source this read */
+
+#define NET_INCLUDE 0
+#define NET_EXCLUDE 1
+#define NET_AGGREGATE 2
+
+struct net_rule {
+    char* pattern;
+    int regex;
+    regex_t compiled;
+    int action;
+    long aggregate; /* index in net_aggregate[] */
+};
+struct net_rule* net_rule = NULL;
+long net_rules = 0;
+int net_includes = 0; /* there are + rules so the default is to leave out */
+
+struct net_aggregate {
+    char* name;
+    long members; /* with a rate this read */
+    double rate[NET_STATS];
+};
+struct net_aggregate* net_aggregate = NULL;
+long net_aggregates = 0;
+
+struct netinfo {
+    char if_name[128];
+    long long unsigned if_stat[NET_STATS];
+    int if_action; /* from the rules */
+    long if_aggregate;
+    long if_sample; /* the read it was last in */
+};
+struct netinfo* net = NULL;
+long interfaces = 0;
+long interfaces_size = 0;
+long* net_hash = NULL; /* index + 1 into net[] or 0 for an empty slot */
+long net_hash_size = 0; /* a power of 2, at least twice interfaces */
+
+/* -o veth*=veth,-lo,~^eth[0-9]+$ returns the rule it could not use or NULL */
+char* net_rules_parse(char* spec)
 {
-    char* p;
-    int spaced = 1;
+    struct net_rule* r;
+    char* s;
+    char* name;
+    long i;
 
-    p = s;
-    for (p = s; *p != 0; p++) {
-        if (*p == ':')
-            *p = ' ';
-        if (*p != ' ') {
-            *s = *p;
+    for (s = strtok(spec, ","); s != NULL; s = strtok(NULL, ",")) {
+        net_rule = realloc(net_rule, sizeof(struct net_rule) * (net_rules + 1));
+        r = &net_rule[net_rules];
+        r->action = NET_INCLUDE;
+        if (*s == '+') {
             s++;
-            spaced = 0;
-        } else if (spaced) {
-            /* do no thing as this is second space */
-        } else {
-            *s = *p;
+            net_includes = 1;
+        } else if (*s == '-') {
             s++;
-            spaced = 1;
+            r->action = NET_EXCLUDE;
+        } else if ((name = strchr(s, '=')) != NULL) {
+            *name++ = 0;
+            if (*name == 0)
+                return s;
+            r->action = NET_AGGREGATE;
+            for (i = 0; i < net_aggregates; i++)
+                if (!strcmp(net_aggregate[i].name, name))
+                    break;
+            if (i == net_aggregates) {
+                net_aggregate = realloc(net_aggregate, sizeof(struct net_aggregate) * (net_aggregates + 1));
+                memset(&net_aggregate[i], 0, sizeof(struct net_aggregate));
+                net_aggregate[i].name = strdup(name);
+                net_aggregates++;
+            }
+            r->aggregate = i;
+        } else
+            net_includes = 1;
+        r->regex = (*s == '~');
+        r->pattern = strdup(s + r->regex);
+        if (r->pattern[0] == 0)
+            return s;
+        if (r->regex && regcomp(&r->compiled, r->pattern, REG_EXTENDED | REG_NOSUB) != 0)
+            return s;
+        net_rules++;
+    }
+    return NULL;
+}
+
+void net_classify(struct netinfo* n)
+{
+    long i;
+
+    for (i = 0; i < net_rules; i++) {
+        if (net_rule[i].regex ? regexec(&net_rule[i].compiled, n->if_name, 0, NULL, 0) == 0
+                              : fnmatch(net_rule[i].pattern, n->if_name, 0) == 0) {
+            n->if_action = net_rule[i].action;
+            n->if_aggregate = net_rule[i].aggregate;
+            return;
         }
     }
-    *s = 0;
+    n->if_action = net_includes ? NET_EXCLUDE : NET_INCLUDE;
 }
 
-void proc_net_dev(double elapsed, int print)
+unsigned long net_hash_name(char* name)
 {
-    struct netinfo {
-        char if_name[128];
-        long long unsigned if_ibytes;
-        long long unsigned if_ipackets;
-        long long unsigned if_ierrs;
-        long long unsigned if_idrop;
-        long long unsigned if_ififo;
-        long long unsigned if_iframe;
-        long long unsigned if_obytes;
-        long long unsigned if_opackets;
-        long long unsigned if_oerrs;
-        long long unsigned if_odrop;
-        long long unsigned if_ofifo;
-        long long unsigned if_ocolls;
-        long long unsigned if_ocarrier;
-    };
-    static struct netinfo current;
-    static struct netinfo* previous = NULL;
-    long long unsigned junk;
+    unsigned long h = 14695981039346656037UL; /* FNV-1a */
 
-    static FILE* fp = 0;
+    while (*name != 0)
+        h = (h ^ (unsigned char)*name++) * 1099511628211UL;
+    return h;
+}
+
+long net_find(char* name)
+{
+    long slot;
+
+    if (net_hash_size == 0)
+        return -1;
+    for (slot = net_hash_name(name) & (net_hash_size - 1); net_hash[slot] != 0; slot = (slot + 1) & (net_hash_size - 1))
+        if (!strcmp(net[net_hash[slot] - 1].if_name, name))
+            return net_hash[slot] - 1;
+    return -1;
+}
+
+void net_hash_insert(long i)
+{
+    long slot;
+
+    for (slot = net_hash_name(net[i].if_name) & (net_hash_size - 1); net_hash[slot] != 0;)
+        slot = (slot + 1) & (net_hash_size - 1);
+    net_hash[slot] = i + 1;
+}
+
+void net_hash_rebuild()
+{
+    long i;
+
+    if (net_hash_size < interfaces * 2) {
+        while (net_hash_size < interfaces * 2)
+            net_hash_size = net_hash_size ? net_hash_size * 2 : 64;
+        net_hash = realloc(net_hash, sizeof(long) * net_hash_size);
+    }
+    memset(net_hash, 0, sizeof(long) * net_hash_size);
+    for (i = 0; i < interfaces; i++)
+        net_hash_insert(i);
+}
+
+/* one interface's counters for this read */
+void net_sample(char* name, long long unsigned* stat, long sample, double elapsed, int print)
+{
+    struct netinfo* n;
+    struct net_aggregate* a;
+    long i;
+    int j;
+
+    if ((i = net_find(name)) < 0) { /* a new one (if it is active), its rates start next time */
+        if (stat[0] + stat[6] == 0)
+            return;
+        if (interfaces == interfaces_size) {
+            interfaces_size = interfaces_size * 2 + 16;
+            net = realloc(net, sizeof(struct netinfo) * interfaces_size);
+        }
+        n = &net[interfaces++];
+        strncpy(n->if_name, name, sizeof(n->if_name) - 1);
+        n->if_name[sizeof(n->if_name) - 1] = 0;
+        memcpy(n->if_stat, stat, sizeof(n->if_stat));
+        n->if_sample = sample;
+        net_classify(n);
+        if (net_hash_size < interfaces * 2)
+            net_hash_rebuild();
+        else
+            net_hash_insert(interfaces - 1);
+        return;
+    }
+    n = &net[i];
+    if (n->if_action == NET_INCLUDE && print) {
+        psub(n->if_name);
+        for (j = 0; j < net_stats; j++)
+            pdouble(net_names[j], (stat[j] - n->if_stat[j]) / elapsed);
+        psubend();
+    } else if (n->if_action == NET_AGGREGATE) {
+        a = &net_aggregate[n->if_aggregate];
+        a->members++;
+        for (j = 0; j < net_stats; j++)
+            a->rate[j] += (stat[j] - n->if_stat[j]) / elapsed;
+    }
+    memcpy(n->if_stat, stat, sizeof(n->if_stat));
+    n->if_sample = sample;
+}
+
+/* after the last net_sample(): the aggregates and drop the interfaces that have gone */
+void net_sample_end(long sample, int print)
+{
+    long i;
+    long j;
+    int k;
+
+    for (i = 0; i < net_aggregates; i++) {
+        if (print) {
+            psub(net_aggregate[i].name);
+            plong("interfaces", net_aggregate[i].members);
+            for (k = 0; k < net_stats; k++)
+                pdouble(net_names[k], net_aggregate[i].rate[k]);
+            psubend();
+        }
+        net_aggregate[i].members = 0;
+        memset(net_aggregate[i].rate, 0, sizeof(net_aggregate[i].rate));
+    }
+    for (i = 0, j = 0; i < interfaces; i++)
+        if (net[i].if_sample == sample)
+            net[j++] = net[i];
+    if (j != interfaces) {
+        interfaces = j;
+        net_hash_rebuild();
+    }
+}
+
+/* - - - netlink - - - */
+#define NET_NETLINK_TRIES 3 /* dumps on a new socket each before /proc/net/dev for good */
+
+int net_netlink_fd = -2; /* -2 not open, -1 failed so use /proc/net/dev */
+char* net_netlink_buf = NULL;
+long net_netlink_size = 0;
+
+int net_netlink_open()
+{
+    struct sockaddr_nl local;
+
+    if ((net_netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0)
+        return 0;
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    if (bind(net_netlink_fd, (struct sockaddr*)&local, sizeof(local)) < 0) {
+        close(net_netlink_fd);
+        net_netlink_fd = -1;
+        return 0;
+    }
+    if (net_netlink_buf == NULL) {
+        net_netlink_size = 64 * 1024;
+        net_netlink_buf = malloc(net_netlink_size);
+    }
+    return 1;
+}
+
+/* the rtnl_link_stats64 of each link in /proc/net/dev terms then the extra ones */
+void net_netlink_stats(struct rtnl_link_stats64* l, long long unsigned* stat)
+{
+    stat[0] = l->rx_bytes;
+    stat[1] = l->rx_packets;
+    stat[2] = l->rx_errors;
+    stat[3] = l->rx_dropped + l->rx_missed_errors;
+    stat[4] = l->rx_fifo_errors;
+    stat[5] = l->rx_length_errors + l->rx_over_errors + l->rx_crc_errors + l->rx_frame_errors;
+    stat[6] = l->tx_bytes;
+    stat[7] = l->tx_packets;
+    stat[8] = l->tx_errors;
+    stat[9] = l->tx_dropped;
+    stat[10] = l->tx_fifo_errors;
+    stat[11] = l->collisions;
+    stat[12] = l->tx_carrier_errors + l->tx_aborted_errors + l->tx_window_errors + l->tx_heartbeat_errors;
+    stat[13] = l->multicast;
+    stat[14] = l->rx_missed_errors;
+    stat[15] = l->rx_nohandler;
+    stat[16] = l->rx_length_errors;
+    stat[17] = l->rx_over_errors;
+    stat[18] = l->rx_crc_errors;
+    stat[19] = l->tx_aborted_errors;
+    stat[20] = l->tx_heartbeat_errors;
+    stat[21] = l->tx_window_errors;
+}
+
+/* one RTM_GETLINK dump of every link into net_netlink_buf, returns the length or -1 */
+long net_netlink_dump(long sample)
+{
+    struct {
+        struct nlmsghdr header;
+        struct ifinfomsg link;
+    } request;
+    struct nlmsghdr* h;
+    long used = 0;
+    long len;
+    long left;
+
+    if (net_netlink_fd == -2 && !net_netlink_open())
+        return -1;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = RTM_GETLINK;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = sample;
+    request.link.ifi_family = AF_UNSPEC;
+    atomic_fetch_add_explicit(&procfile_syscalls, 1, memory_order_relaxed);
+    if (send(net_netlink_fd, &request, sizeof(request), 0) < 0)
+        return -1;
+    for (;;) {
+        if (net_netlink_size - used < 32 * 1024) { /* the kernel fills a datagram up to 32 KB */
+            net_netlink_size *= 2;
+            net_netlink_buf = realloc(net_netlink_buf, net_netlink_size);
+        }
+        atomic_fetch_add_explicit(&procfile_syscalls, 1, memory_order_relaxed);
+        if ((len = recv(net_netlink_fd, &net_netlink_buf[used], net_netlink_size - used, 0)) < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return -1;
+        left = len;
+        for (h = (struct nlmsghdr*)&net_netlink_buf[used]; NLMSG_OK(h, left); h = NLMSG_NEXT(h, left)) {
+            if (h->nlmsg_seq != (uint32_t)sample)
+                continue; /* left over from a dump that failed part way */
+            if (h->nlmsg_type == NLMSG_ERROR)
+                return -1;
+            if (h->nlmsg_type == NLMSG_DONE)
+                return used + len;
+        }
+        used += len;
+    }
+}
+
+/* feed each link of the dump to net_sample, returns 0 if netlink did not work */
+int net_netlink(long sample, long long unsigned now, double elapsed, int print)
+{
+    struct nlmsghdr* h;
+    struct ifinfomsg* link;
+    struct rtattr* attr;
+    struct rtnl_link_stats64 stats;
+    long long unsigned stat[NET_STATS];
+    char* name;
+    long len;
+    int attrlen;
+    int found;
+
+    if ((len = net_netlink_dump(sample)) < 0)
+        return 0;
+    if (print) {
+        psection("networks");
+        pulong("sampled_at", now);
+    }
+    for (h = (struct nlmsghdr*)net_netlink_buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+        if (h->nlmsg_seq != (uint32_t)sample || h->nlmsg_type != RTM_NEWLINK)
+            continue;
+        link = NLMSG_DATA(h);
+        name = NULL;
+        found = 0;
+        attrlen = IFLA_PAYLOAD(h);
+        for (attr = IFLA_RTA(link); RTA_OK(attr, attrlen); attr = RTA_NEXT(attr, attrlen)) {
+            if (attr->rta_type == IFLA_IFNAME)
+                name = RTA_DATA(attr);
+            else if (attr->rta_type == IFLA_STATS64) {
+                /* copied as older kernels send a shorter struct and it may not be aligned */
+                memset(&stats, 0, sizeof(stats));
+                memcpy(&stats, RTA_DATA(attr), RTA_PAYLOAD(attr) < sizeof(stats) ? RTA_PAYLOAD(attr) : sizeof(stats));
+                found = 1;
+            }
+        }
+        if (name != NULL && found) {
+            net_netlink_stats(&stats, stat);
+            net_sample(name, stat, sample, elapsed, print);
+        }
+    }
+    net_sample_end(sample, print);
+    if (print)
+        psectionend();
+    return 1;
+}
+
+void proc_net_dev(int print)
+{
+    static struct source_time stamp;
+    static long sample = 0;
+    double elapsed;
+    long long fields[15];
+    long long unsigned stat[NET_STATS];
+    char* pos;
+    char* name;
+    char if_name[128];
+
+    static struct procfile file = { "/proc/net/dev", -1 };
     char buf[1024];
-    static long interfaces = 0;
+    int tries;
     int ret;
-    /* popen variables */
-    long i;
+    int i;
 
     FUNCTION_START;
-    if (fp == (FILE*)0) {
-        if ((fp = fopen("/proc/net/dev", "r")) == NULL) {
-            error("failed to open - /proc/net/dev");
+    elapsed = source_read(&stamp); /* once, whichever source answers */
+    sample++;
+    for (tries = 0; net_netlink_fd != -1 && tries < NET_NETLINK_TRIES; tries++) {
+        net_stats = NET_STATS;
+        if (net_netlink(sample, stamp.now, elapsed, print))
             return;
+        if (net_netlink_fd >= 0) { /* ENOBUFS or a lost dump, try again on a new socket */
+            close(net_netlink_fd);
+            net_netlink_fd = -2;
         }
-    } else
-        rewind(fp);
+    }
+    net_netlink_fd = -1; /* netlink does not work here, /proc/net/dev from now on */
+    net_stats = NET_PROC_STATS;
+    if (procfile_read(&file) < 0) {
+        error("failed to open - /proc/net/dev");
+        return;
+    }
+
+    if (procfile_gets(buf, 1024, &file) == NULL)
+        return; /* throw away the header line */
+    if (procfile_gets(buf, 1024, &file) == NULL)
+        return; /* throw away the header line */
+
+    if (print) {
+        psection("networks");
+        pulong("sampled_at", stamp.now);
+    }
+    while (procfile_gets(buf, 1024, &file) != NULL) {
+        ret = 0;
+        if ((pos = strchr(buf, ':')) != NULL) { /* "  name: numbers" */
+            *pos++ = 0;
+            name = buf;
+            if (scan_word(&name, if_name, sizeof(if_name)))
+                ret = 1 + scan_numbers(&pos, fields, 15);
+        }
+        if (ret == 16) {
+            for (i = 0; i < 6; i++)
+                stat[i] = fields[i];
+            /* fields 6 and 7 are compressed and multicast */
+            for (i = 6; i < NET_PROC_STATS; i++)
+                stat[i] = fields[i + 2];
+            net_sample(if_name, stat, sample, elapsed, print);
+        } else {
+            fprintf(stderr, "net sscanf wanted 16 returned = %d line=%s\n", ret, (char*)buf);
+        }
+    }
+    net_sample_end(sample, print);
+    if (print)
+        psectionend();
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   cgroups (-g depth=N,top=K)
+*    Each cgroup v2 directory under /sys/fs/cgroup, or /sys/fs/cgroup/unified on
+*    a hybrid host: CPU use and throttling from cpu.stat, memory.current, the
+*    memory.events since the cgroup was last output, the io.stat rates added up
+*    over the devices and its cpu, memory and io pressure. The directories are
+*    kept open so each file is an openat(), pread() and close(), cpu.stat stays
+*    open and is just a pread() as it is read every sample, and the tree is
+*    walked again only when inotify says a directory came or went (every sample
+*    if there is no inotify). depth=N leaves out cgroups more than N levels
+*    down. top=K outputs only the K using the most CPU: cpu.stat is read for
+*    every cgroup to rank them, the other files just for the ones output, so
+*    their rates are over the time since they were last read.
+*/
+#define CGROUP_VALUES 6 /* the most any file has */
+
+char* cgroup_cpu_names[] = { "usage_usec", "user_usec", "system_usec", "nr_periods", "nr_throttled", "throttled_usec", NULL };
+char* cgroup_event_names[] = { "low", "high", "max", "oom", "oom_kill", NULL };
+char* cgroup_io_names[] = { "rbytes", "wbytes", "rios", "wios", "dbytes", "dios", NULL };
+
+/* one file's counters at its last two reads */
+struct cgroup_counters {
+    int found; /* bit per name in the file, 0 if the file is not there */
+    long long value[CGROUP_VALUES];
+    long long previous[CGROUP_VALUES];
+    long long unsigned when;
+    double elapsed; /* seconds between the two reads or 0 */
+};
+
+#define CGROUP_RATE(c, i) ((c)->elapsed > 0 ? ((c)->value[i] - (c)->previous[i]) / (c)->elapsed : 0.0)
+
+struct cgroupinfo {
+    char path[512]; /* under the root, "/" for the root itself */
+    int fd; /* the directory, -1 if out of file descriptors */
+    int cpu_fd; /* cpu.stat is read every sample so it stays open too */
+    int wd; /* inotify watch or -1 */
+    ino_t ino; /* to tell a cgroup made again under the same path */
+    int depth;
+    long scan; /* the walk it was last found in */
+    double cpu_rate; /* usage_usec per second for top=K */
+    struct cgroup_counters cpu;
+    struct cgroup_counters events;
+    struct cgroup_counters io;
+    long long memory_current; /* -1 without the memory controller */
+    struct pressure_line pressure[PRESSURE_RESOURCES][2];
+    long long unsigned pressure_when;
+    double pressure_elapsed;
+};
+struct cgroupinfo* cgroup = NULL;
+long cgroups = 0;
+long cgroups_size = 0;
+long* cgroup_order = NULL; /* output order, busiest first with top=K */
+long* cgroup_hash = NULL; /* index + 1 into cgroup[] or 0 for an empty slot */
+long cgroup_hash_size = 0;
+
+char* cgroup_root = NULL;
+int cgroup_root_fd = -1;
+int cgroup_inotify = -1;
+int cgroup_rescan = 1;
+long cgroup_scans = 0;
+int cgroup_depth = -1; /* -1 for every level */
+long cgroup_top = 0; /* 0 for all */
+
+/* -g depth=2,top=20 or -g all */
+int cgroup_options_parse(char* spec)
+{
+    char* s;
+
+    for (s = strtok(spec, ","); s != NULL; s = strtok(NULL, ",")) {
+        if (!strncmp(s, "depth=", 6) && SCAN_DIGIT(s[6]))
+            cgroup_depth = atoi(&s[6]);
+        else if (!strncmp(s, "top=", 4) && SCAN_DIGIT(s[4]))
+            cgroup_top = atol(&s[4]);
+        else if (strcmp(s, "all"))
+            return 0;
+    }
+    return 1;
+}
+
+long cgroup_find(char* path)
+{
+    long slot;
+
+    if (cgroup_hash_size == 0)
+        return -1;
+    for (slot = net_hash_name(path) & (cgroup_hash_size - 1); cgroup_hash[slot] != 0; slot = (slot + 1) & (cgroup_hash_size - 1))
+        if (!strcmp(cgroup[cgroup_hash[slot] - 1].path, path))
+            return cgroup_hash[slot] - 1;
+    return -1;
+}
+
+void cgroup_hash_rebuild()
+{
+    long slot;
+    long i;
+
+    if (cgroup_hash_size < cgroups * 2) {
+        while (cgroup_hash_size < cgroups * 2)
+            cgroup_hash_size = cgroup_hash_size ? cgroup_hash_size * 2 : 64;
+        cgroup_hash = realloc(cgroup_hash, sizeof(long) * cgroup_hash_size);
+    }
+    memset(cgroup_hash, 0, sizeof(long) * cgroup_hash_size);
+    for (i = 0; i < cgroups; i++) {
+        for (slot = net_hash_name(cgroup[i].path) & (cgroup_hash_size - 1); cgroup_hash[slot] != 0;)
+            slot = (slot + 1) & (cgroup_hash_size - 1);
+        cgroup_hash[slot] = i + 1;
+    }
+}
+
+/* the path for openat() on cgroup_root_fd: "." for the root and no leading / */
+char* cgroup_relative(char* path)
+{
+    return path[1] == 0 ? "." : &path[1];
+}
+
+/* open the directory of g with its path and depth set, everything else starts again */
+void cgroup_open(struct cgroupinfo* g)
+{
+    struct stat st;
+    char path[512];
+    int depth = g->depth;
+
+    strcpy(path, g->path);
+    memset(g, 0, sizeof(struct cgroupinfo));
+    strcpy(g->path, path);
+    g->depth = depth;
+    g->cpu_fd = -1;
+    g->wd = -1;
+    g->memory_current = -1;
+    atomic_fetch_add_explicit(&procfile_syscalls, 2, memory_order_relaxed);
+    g->fd = openat(cgroup_root_fd, cgroup_relative(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC); /* -1 when out of fds */
+    if (g->fd >= 0 ? fstat(g->fd, &st) == 0 : fstatat(cgroup_root_fd, cgroup_relative(path), &st, 0) == 0)
+        g->ino = st.st_ino;
+}
+
+void cgroup_close(struct cgroupinfo* g)
+{
+    if (g->fd >= 0)
+        close(g->fd);
+    if (g->cpu_fd >= 0)
+        close(g->cpu_fd);
+    if (g->wd >= 0)
+        inotify_rm_watch(cgroup_inotify, g->wd); /* already gone if the directory went */
+}
+
+long cgroup_add(char* path, int depth)
+{
+    struct cgroupinfo* g;
+
+    if (cgroups == cgroups_size) {
+        cgroups_size = cgroups_size * 2 + 64;
+        cgroup = realloc(cgroup, sizeof(struct cgroupinfo) * cgroups_size);
+        cgroup_order = realloc(cgroup_order, sizeof(long) * cgroups_size);
+    }
+    g = &cgroup[cgroups];
+    strcpy(g->path, path);
+    g->depth = depth;
+    cgroup_open(g);
+    cgroups++;
+    cgroup_hash_rebuild();
+    return cgroups - 1;
+}
+
+/* find the directories under cgroup i */
+void cgroup_walk(long i)
+{
+    DIR* dir;
+    struct dirent* d;
+    char path[1024];
+    long j;
+    int fd;
+
+    cgroup[i].scan = cgroup_scans;
+    if (cgroup_depth >= 0 && cgroup[i].depth >= cgroup_depth)
+        return;
+    if (cgroup_inotify >= 0 && cgroup[i].wd < 0) {
+        snprintf(path, sizeof(path), "%s%s", cgroup_root, cgroup[i].path);
+        cgroup[i].wd = inotify_add_watch(cgroup_inotify, path, IN_CREATE | IN_DELETE | IN_MOVE | IN_ONLYDIR);
+    }
+    atomic_fetch_add_explicit(&procfile_syscalls, 1, memory_order_relaxed);
+    if (cgroup[i].fd >= 0)
+        fd = openat(cgroup[i].fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    else
+        fd = openat(cgroup_root_fd, cgroup_relative(cgroup[i].path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || (dir = fdopendir(fd)) == NULL) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    while ((d = readdir(dir)) != NULL) {
+        if (d->d_type != DT_DIR || d->d_name[0] == '.')
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", cgroup[i].path[1] ? cgroup[i].path : "", d->d_name) >= (int)sizeof(cgroup->path))
+            continue;
+        if ((j = cgroup_find(path)) < 0) {
+            j = cgroup_add(path, cgroup[i].depth + 1);
+        } else if (d->d_ino != cgroup[j].ino) { /* removed and made again since the last walk */
+            cgroup_close(&cgroup[j]);
+            cgroup_open(&cgroup[j]);
+        }
+        cgroup_walk(j);
+    }
+    closedir(dir);
+}
+
+/* walk the tree and forget the cgroups that went */
+void cgroup_scan()
+{
+    long i;
+    long kept;
+
+    cgroup_scans++;
+    cgroup_rescan = 0;
+    if (cgroups == 0)
+        cgroup_add("/", 0);
+    cgroup_walk(0);
+    for (i = 0, kept = 0; i < cgroups; i++) {
+        if (cgroup[i].scan != cgroup_scans) {
+            cgroup_close(&cgroup[i]);
+            continue;
+        }
+        if (kept != i)
+            memcpy(&cgroup[kept], &cgroup[i], sizeof(struct cgroupinfo));
+        kept++;
+    }
+    if (kept != cgroups) {
+        cgroups = kept;
+        cgroup_hash_rebuild();
+    }
+}
+
+/* find the cgroup2 mount, returns 0 if there is none */
+int cgroup_init()
+{
+    struct statfs fs;
+    struct rlimit limit;
+
+    if (statfs("/sys/fs/cgroup", &fs) == 0 && fs.f_type == CGROUP2_SUPER_MAGIC)
+        cgroup_root = "/sys/fs/cgroup";
+    else if (statfs("/sys/fs/cgroup/unified", &fs) == 0 && fs.f_type == CGROUP2_SUPER_MAGIC)
+        cgroup_root = "/sys/fs/cgroup/unified";
+    else
+        return 0;
+    if ((cgroup_root_fd = open(cgroup_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return 0;
+    /* a directory fd per cgroup, so as many as the hard limit allows */
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    cgroup_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    cgroup_scan();
+    return 1;
+}
+
+/* read a file of the cgroup, kept open in *keep when it is not NULL or opened and closed */
+long cgroup_file(struct cgroupinfo* g, char* name, int* keep, char* buf, long size)
+{
+    char path[1024];
+    long len;
+    int fd = keep != NULL ? *keep : -1;
+
+    if (fd < 0) {
+        atomic_fetch_add_explicit(&procfile_syscalls, 1, memory_order_relaxed);
+        if (g->fd >= 0) {
+            fd = openat(g->fd, name, O_RDONLY | O_CLOEXEC);
+        } else {
+            snprintf(path, sizeof(path), "%s/%s", cgroup_relative(g->path), name);
+            fd = openat(cgroup_root_fd, path, O_RDONLY | O_CLOEXEC);
+        }
+        if (fd < 0)
+            return -1;
+    }
+    atomic_fetch_add_explicit(&procfile_syscalls, 1, memory_order_relaxed);
+    len = pread(fd, buf, size - 1, 0);
+    if (keep != NULL && len >= 0) {
+        *keep = fd;
+    } else {
+        atomic_fetch_add_explicit(&procfile_syscalls, 1, memory_order_relaxed);
+        close(fd);
+        if (keep != NULL)
+            *keep = -1;
+    }
+    if (len >= 0)
+        buf[len] = 0;
+    return len;
+}
+
+/* add up the "name value" and "name=value" pairs, io.stat has a line of them per device */
+int cgroup_keys(char* buf, char** names, long long* values)
+{
+    char word[32];
+    char* pos = buf;
+    char* end;
+    long long value;
+    int found = 0;
+    int len;
+    int i;
+
+    memset(values, 0, sizeof(long long) * CGROUP_VALUES);
+    while (*pos != 0) {
+        while (SCAN_BLANK(*pos) || *pos == '\n')
+            pos++;
+        for (len = 0; *pos != 0 && *pos != '=' && !SCAN_BLANK(*pos) && *pos != '\n'; pos++)
+            if (len < (int)sizeof(word) - 1)
+                word[len++] = *pos;
+        word[len] = 0;
+        if (*pos == '=')
+            pos++;
+        if (len == 0 || (end = scan_number(pos, &value)) == NULL)
+            continue; /* like the "8:0" device of io.stat */
+        pos = end;
+        for (i = 0; names[i] != NULL; i++) {
+            if (!strcmp(word, names[i])) {
+                values[i] += value;
+                found |= 1 << i;
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+void cgroup_counters_read(struct cgroupinfo* g, char* name, int* keep, char** names, struct cgroup_counters* c)
+{
+    char buf[16 * 1024]; /* io.stat of the root has a line per device */
+    long long unsigned now;
+
+    if (cgroup_file(g, name, keep, buf, sizeof(buf)) < 0) {
+        c->found = 0;
+        return;
+    }
+    now = nanoschedtime();
+    memcpy(c->previous, c->value, sizeof(c->value));
+    if (c->found == 0) {
+        c->found = cgroup_keys(buf, names, c->value);
+        memcpy(c->previous, c->value, sizeof(c->value));
+        c->elapsed = 0.0;
+    } else {
+        c->found = cgroup_keys(buf, names, c->value);
+        c->elapsed = (now - c->when) / 1e9;
+    }
+    c->when = now;
+}
+
+/* the busiest first for top=K */
+int cgroup_busier(const void* a, const void* b)
+{
+    double x = cgroup[*(long*)a].cpu_rate;
+    double y = cgroup[*(long*)b].cpu_rate;
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void sys_fs_cgroup(int print)
+{
+    static struct source_time stamp;
+    struct cgroupinfo* g;
+    struct cgroup_counters* c;
+    struct pressure_line* l;
+    struct procfile file;
+    char buf[4096];
+    char label[64];
+    long long unsigned now;
+    long long throttled;
+    long long periods;
+    long n;
+    long i;
+    int k;
+    int r;
+
+    FUNCTION_START;
+    if (cgroup_root_fd < 0)
+        return;
+    if (cgroup_inotify >= 0) {
+        atomic_fetch_add_explicit(&procfile_syscalls, 1, memory_order_relaxed);
+        while (read(cgroup_inotify, buf, sizeof(buf)) > 0) { /* drain, any event means walk again */
+            atomic_fetch_add_explicit(&procfile_syscalls, 1, memory_order_relaxed);
+            cgroup_rescan = 1;
+        }
+    }
+    if (cgroup_rescan || cgroup_inotify < 0)
+        cgroup_scan();
+    source_read(&stamp);
+
+    for (i = 0; i < cgroups; i++) {
+        g = &cgroup[i];
+        cgroup_counters_read(g, "cpu.stat", &g->cpu_fd, cgroup_cpu_names, &g->cpu);
+        g->cpu_rate = CGROUP_RATE(&g->cpu, 0);
+        cgroup_order[i] = i;
+    }
+    n = cgroups;
+    if (cgroup_top > 0 && cgroup_top < cgroups) {
+        qsort(cgroup_order, cgroups, sizeof(long), cgroup_busier);
+        n = cgroup_top;
+    }
 
-    if (fgets(buf, 1024, fp) == NULL)
-        return; /* throw away the header line */
-    if (fgets(buf, 1024, fp) == NULL)
-        return; /* throw away the header line */
+    if (print) {
+        psection("cgroups");
+        pulong("sampled_at", stamp.now);
+        plong("cgroups", cgroups);
+    }
+    for (i = 0; i < n; i++) {
+        g = &cgroup[cgroup_order[i]];
+        if (g->cpu.found == 0)
+            continue; /* went since the walk */
+        cgroup_counters_read(g, "memory.events", NULL, cgroup_event_names, &g->events);
+        cgroup_counters_read(g, "io.stat", NULL, cgroup_io_names, &g->io);
+        g->memory_current = -1;
+        if (cgroup_file(g, "memory.current", NULL, buf, sizeof(buf)) > 0)
+            scan_number(buf, &g->memory_current);
+        now = nanoschedtime();
+        g->pressure_elapsed = g->pressure_when ? (now - g->pressure_when) / 1e9 : 0.0;
+        g->pressure_when = now;
+        for (r = 0; r < PRESSURE_RESOURCES; r++) {
+            snprintf(label, sizeof(label), "%s.pressure", pressure_names[r]);
+            memset(&file, 0, sizeof(file));
+            file.buf = buf;
+            if ((file.len = cgroup_file(g, label, NULL, buf, sizeof(buf))) < 0)
+                g->pressure[r][0].found = g->pressure[r][1].found = 0;
+            else
+                pressure_scan(&file, g->pressure[r]);
+        }
+        if (!print)
+            continue;
 
-    if (print)
-        psection("networks");
-    while (fgets(buf, 1024, fp) != NULL) {
-        strip_spaces(buf);
-        bzero(&current, sizeof(struct netinfo));
-        ret = sscanf(&buf[0],
-            "%s %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
-            (char*)current.if_name,
-            &current.if_ibytes,
-            &current.if_ipackets,
-            &current.if_ierrs,
-            &current.if_idrop,
-            &current.if_ififo,
-            &current.if_iframe,
-            &junk,
-            &junk,
-            &current.if_obytes,
-            &current.if_opackets,
-            &current.if_oerrs,
-            &current.if_odrop,
-            &current.if_ofifo,
-            &current.if_ocolls,
-            &current.if_ocarrier);
-        if (ret == 16) {
-            for (i = 0; i < interfaces; i++) {
-                if (!strcmp(current.if_name, previous[i].if_name)) {
-                    if (print) {
-                        psub(current.if_name);
-                        pdouble("ibytes", (current.if_ibytes - previous[i].if_ibytes) / elapsed);
-                        pdouble("ipackets", (current.if_ipackets - previous[i].if_ipackets) / elapsed);
-                        pdouble("ierrs", (current.if_ierrs - previous[i].if_ierrs) / elapsed);
-                        pdouble("idrop", (current.if_idrop - previous[i].if_idrop) / elapsed);
-                        pdouble("ififo", (current.if_ififo - previous[i].if_ififo) / elapsed);
-                        pdouble("iframe", (current.if_iframe - previous[i].if_iframe) / elapsed);
-
-                        pdouble("obytes", (current.if_obytes - previous[i].if_obytes) / elapsed);
-                        pdouble("opackets", (current.if_opackets - previous[i].if_opackets) / elapsed);
-                        pdouble("oerrs", (current.if_oerrs - previous[i].if_oerrs) / elapsed);
-                        pdouble("odrop", (current.if_odrop - previous[i].if_odrop) / elapsed);
-                        pdouble("ofifo", (current.if_ofifo - previous[i].if_ofifo) / elapsed);
-
-                        pdouble("ocolls", (current.if_ocolls - previous[i].if_ocolls) / elapsed);
-                        pdouble("ocarrier", (current.if_ocarrier - previous[i].if_ocarrier) / elapsed);
-                        psubend();
-                    }
-                    memcpy(&previous[i], &current, sizeof(struct netinfo));
-                    break; /* once found stop searching */
-                }
-            }
-            if (i == interfaces) { /* no match means we have a new one (if it is active) */
-                if (current.if_ibytes + current.if_obytes > 0) {
-                    interfaces++;
-                    previous = realloc(previous, sizeof(struct netinfo) * interfaces);
-                    memcpy(&previous[interfaces - 1], &current, sizeof(struct netinfo));
-                }
+        psub(g->path);
+        c = &g->cpu;
+        pdouble("cpu_pct", CGROUP_RATE(c, 0) / 1e4);
+        pdouble("user_pct", CGROUP_RATE(c, 1) / 1e4);
+        pdouble("sys_pct", CGROUP_RATE(c, 2) / 1e4);
+        if (c->found & (1 << 3)) { /* with the cpu controller */
+            periods = c->value[3] - c->previous[3];
+            throttled = c->value[4] - c->previous[4];
+            pdouble("throttled_periods_pct", periods > 0 ? 100.0 * throttled / periods : 0.0);
+            pdouble("throttled_pct", CGROUP_RATE(c, 5) / 1e4);
+        }
+        if (g->memory_current >= 0)
+            pulong("memory_current", g->memory_current);
+        c = &g->events;
+        for (k = 0; c->found && cgroup_event_names[k] != NULL; k++) {
+            snprintf(label, sizeof(label), "memory_%s", cgroup_event_names[k]);
+            plong(label, c->value[k] - c->previous[k]);
+        }
+        c = &g->io;
+        for (k = 0; c->found && cgroup_io_names[k] != NULL; k++) {
+            snprintf(label, sizeof(label), "io_%s", cgroup_io_names[k]);
+            pdouble(label, CGROUP_RATE(c, k));
+        }
+        for (r = 0; r < PRESSURE_RESOURCES; r++) {
+            for (k = 0; k < 2; k++) {
+                l = &g->pressure[r][k];
+                if (!l->found)
+                    continue;
+                snprintf(label, sizeof(label), "%s_%s_avg10", pressure_names[r], k ? "full" : "some");
+                pdouble(label, l->avg[0]);
+                snprintf(label, sizeof(label), "%s_%s_stall_pct", pressure_names[r], k ? "full" : "some");
+                pdouble(label, g->pressure_elapsed > 0 ? (l->total - l->previous) / g->pressure_elapsed / 1e4 : 0.0);
             }
-        } else {
-            fprintf(stderr, "net sscanf wanted 16 returned = %d line=%s\n", ret, (char*)buf);
         }
+        psubend();
     }
     if (print)
         psectionend();
@@ -1924,7 +5188,7 @@ void lscpu()
 
 void proc_uptime()
 {
-    static FILE* fp = 0;
+    static struct procfile file = { "/proc/uptime", -1 };
     char buf[1024 + 1];
     int count;
     long long value;
@@ -1932,15 +5196,11 @@ void proc_uptime()
     long long hours;
 
     FUNCTION_START;
-    if (fp == 0) {
-        if ((fp = fopen("/proc/uptime", "r")) == NULL) {
-            return;
-        }
-    } else
-        rewind(fp);
+    if (procfile_read(&file) < 0)
+        return;
 
-    if (fgets(buf, 1024, fp) != NULL) {
-        count = sscanf(buf, "%lld", &value);
+    if (procfile_gets(buf, 1024, &file) != NULL) {
+        count = scan_number(buf, &value) != NULL;
         if (count == 1) {
             psection("proc_uptime");
             plong("total_seconds", value);
@@ -1953,49 +5213,259 @@ void proc_uptime()
     }
 }
 
-void filesystems()
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   filesystems (-F)
+*    The mounts come from /proc/self/mountinfo, which is read again only when
+*    poll() on it says the mount table changed. statfs() of a hung NFS or GPFS
+*    mount never returns, so the calls are made by a helper thread while the
+*    collector waits up to FILESYSTEM_DEADLINE for each. A mount that misses
+*    its deadline is output as "stale" with its last figures, the helper is
+*    left stuck in it and a new one takes over the rest. The mount is skipped
+*    until that statfs() returns.
+*/
+#define FILESYSTEM_DEADLINE 500000000ULL /* nanoseconds */
+
+struct filesystem {
+    char fsname[256];
+    char dir[256];
+    char type[64];
+    char opts[512];
+    struct statfs vfs; /* the last statfs() that worked */
+    int found; /* vfs is there */
+    int err; /* errno of the last statfs() or 0 */
+    int hung; /* a statfs() went past its deadline and has not returned */
+};
+struct filesystem* filesystem = NULL;
+long filesystems_count = 0;
+long filesystems_list = 0; /* bumped each time the mount table is read */
+
+pthread_mutex_t filesystem_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t filesystem_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t filesystem_done; /* on CLOCK_MONOTONIC, set up with the first helper */
+long filesystem_helper = 0; /* the helper that is not stuck, older ones quit when their statfs() returns */
+long filesystem_next; /* the next mount for the helper this round */
+long filesystem_busy = -1; /* the mount the helper is in */
+long long unsigned filesystem_busy_since;
+
+/* undo the \040 style octal escapes of spaces, tabs and newlines in mountinfo */
+void filesystem_unescape(char* to, char* from, long size)
 {
-    FILE* fp;
-    struct mntent* fs;
+    long i;
+
+    for (i = 0; *from != 0 && i < size - 1; i++) {
+        if (from[0] == '\\' && SCAN_DIGIT(from[1]) && SCAN_DIGIT(from[2]) && SCAN_DIGIT(from[3])) {
+            to[i] = (from[1] - '0') * 64 + (from[2] - '0') * 8 + (from[3] - '0');
+            from += 4;
+        } else
+            to[i] = *from++;
+    }
+    to[i] = 0;
+}
+
+/* find the mount in filesystem[] again after the list changed, -1 if it went */
+long filesystem_find(char* dir)
+{
+    long i;
+
+    for (i = 0; i < filesystems_count; i++)
+        if (!strcmp(filesystem[i].dir, dir))
+            return i;
+    return -1;
+}
+
+void* filesystem_main(void* arg)
+{
+    long me = (long)arg;
+    long list;
+    long i;
     struct statfs vfs;
-    char buf[1024];
+    char dir[256];
+    int ret;
+    int err;
+
+    pthread_mutex_lock(&filesystem_lock);
+    for (;;) {
+        while (me == filesystem_helper && filesystem_next >= filesystems_count)
+            pthread_cond_wait(&filesystem_work, &filesystem_lock);
+        if (me != filesystem_helper)
+            break;
+        i = filesystem_next++;
+        if (filesystem[i].hung) {
+            pthread_cond_signal(&filesystem_done);
+            continue;
+        }
+        strcpy(dir, filesystem[i].dir);
+        list = filesystems_list;
+        filesystem_busy = i;
+        filesystem_busy_since = nanoschedtime();
+        pthread_cond_signal(&filesystem_done); /* the collector times the deadline from now */
+        pthread_mutex_unlock(&filesystem_lock);
+
+        ret = statfs(dir, &vfs);
+        err = errno;
+
+        pthread_mutex_lock(&filesystem_lock);
+        if (list != filesystems_list) /* the mount table was read again meanwhile */
+            i = filesystem_find(dir);
+        if (i >= 0) {
+            filesystem[i].hung = 0;
+            filesystem[i].err = ret == 0 ? 0 : err;
+            if (ret == 0) {
+                filesystem[i].vfs = vfs;
+                filesystem[i].found = 1;
+            }
+        }
+        if (me != filesystem_helper) /* given up on, a new helper has the rest */
+            break;
+        filesystem_busy = -1;
+        pthread_cond_signal(&filesystem_done);
+    }
+    pthread_mutex_unlock(&filesystem_lock);
+    return NULL;
+}
+
+/* a helper thread for the statfs() calls, call with filesystem_lock held */
+void filesystem_helper_start()
+{
+    pthread_t helper;
+
+    filesystem_helper++;
+    filesystem_busy = -1;
+    if (pthread_create(&helper, NULL, filesystem_main, (void*)filesystem_helper) != 0)
+        pexit("precimon: filesystem helper pthread_create() failed");
+    pthread_detach(helper);
+}
+
+/* read /proc/self/mountinfo into filesystem[] keeping what is known of the mounts that stay */
+void filesystem_mounts(struct procfile* file)
+{
+    struct filesystem* list = NULL;
+    struct filesystem* fs;
+    char line[4096];
+    char* field[32];
+    char* pos;
+    long count = 0;
+    long i;
+    int fields;
+    int dash;
+
+    /* 36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 /dev/root rw,errors=continue */
+    while (procfile_gets(line, sizeof(line), file) != NULL) {
+        for (fields = 0, pos = strtok(line, " \n"); pos != NULL && fields < 32; pos = strtok(NULL, " \n"))
+            field[fields++] = pos;
+        for (dash = 6; dash < fields && strcmp(field[dash], "-"); dash++)
+            ;
+        if (dash + 3 >= fields)
+            continue;
+        if (field[dash + 2][0] != '/') /* only mounts of a device or path */
+            continue;
+        if (strncmp(field[dash + 1], "autofs", 6) == 0) /* skip autofs file systems as they don't have I/O stats */
+            continue;
+        list = realloc(list, sizeof(struct filesystem) * (count + 1));
+        fs = &list[count++];
+        memset(fs, 0, sizeof(struct filesystem));
+        filesystem_unescape(fs->fsname, field[dash + 2], sizeof(fs->fsname));
+        filesystem_unescape(fs->dir, field[4], sizeof(fs->dir));
+        filesystem_unescape(fs->type, field[dash + 1], sizeof(fs->type));
+        /* the per mount options then the file system's without its rw or ro as /etc/mtab had them */
+        pos = strchr(field[dash + 3], ',');
+        snprintf(fs->opts, sizeof(fs->opts), "%s%s", field[5], pos != NULL ? pos : "");
+    }
+
+    pthread_mutex_lock(&filesystem_lock);
+    for (i = 0; i < count; i++) {
+        long old = filesystem_find(list[i].dir);
+
+        if (old >= 0) {
+            list[i].vfs = filesystem[old].vfs;
+            list[i].found = filesystem[old].found;
+            list[i].err = filesystem[old].err;
+            list[i].hung = filesystem[old].hung;
+        }
+    }
+    free(filesystem);
+    filesystem = list;
+    filesystems_count = count;
+    filesystems_list++;
+    filesystem_next = count; /* nothing to do until the next round */
+    pthread_mutex_unlock(&filesystem_lock);
+}
+
+void filesystems()
+{
+    static struct procfile file = { "/proc/self/mountinfo", -1 };
+    struct pollfd changed;
+    struct filesystem* fs;
+    struct timespec until;
+    pthread_condattr_t attr;
+    long long unsigned when;
+    long i;
 
     FUNCTION_START;
-    if ((fp = setmntent("/etc/mtab", "r")) == NULL)
-        error("setmntent(\"/etc/mtab\", \"r\") failed");
+    changed.fd = file.fd;
+    changed.events = POLLPRI;
+    changed.revents = 0;
+    if (file.fd >= 0) {
+        atomic_fetch_add_explicit(&procfile_syscalls, 1, memory_order_relaxed);
+        poll(&changed, 1, 0);
+    }
+    if (file.fd < 0 || (changed.revents & (POLLPRI | POLLERR))) {
+        if (procfile_read(&file) < 0)
+            error("failed to open - /proc/self/mountinfo");
+        filesystem_mounts(&file);
+    }
 
-    psection("filesystems");
-    while ((fs = getmntent(fp)) != NULL) {
-        if (fs->mnt_fsname[0] == '/') {
-            if (statfs(fs->mnt_dir, &vfs) != 0) {
-                sprintf(buf, "%s: statfs failed: %s\n", fs->mnt_dir, strerror(errno));
-                error(buf); /* does not return */
-            }
-            if (strncmp(fs->mnt_type, "autofs", 6) == 0) /* skip autofs file systems as they don't have I/O stats */
-                continue;
+    pthread_mutex_lock(&filesystem_lock);
+    if (filesystem_helper == 0) {
+        pthread_condattr_init(&attr); /* the deadlines are nanoschedtime() */
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&filesystem_done, &attr);
+        filesystem_helper_start();
+    }
+    filesystem_next = 0;
+    pthread_cond_signal(&filesystem_work);
+    while (filesystem_next < filesystems_count || filesystem_busy >= 0) {
+        if (filesystem_busy < 0) { /* the helper has not picked the next one up yet */
+            pthread_cond_wait(&filesystem_done, &filesystem_lock);
+            continue;
+        }
+        when = filesystem_busy_since + FILESYSTEM_DEADLINE;
+        until.tv_sec = when / 1000000000ULL;
+        until.tv_nsec = when % 1000000000ULL;
+        if (pthread_cond_timedwait(&filesystem_done, &filesystem_lock, &until) == ETIMEDOUT
+            && filesystem_busy >= 0 && nanoschedtime() >= when) {
+            filesystem[filesystem_busy].hung = 1;
+            filesystem_helper_start();
+            pthread_cond_signal(&filesystem_work);
+        }
+    }
 
-            psub(fs->mnt_fsname);
-            pstring("fs_dir", fs->mnt_dir);
-            pstring("fs_type", fs->mnt_type);
-            pstring("fs_opts", fs->mnt_opts);
-
-            plong("fs_freqs", fs->mnt_freq);
-            plong("fs_passno", fs->mnt_passno);
-            plong("fs_bsize", vfs.f_bsize);
-            plong("fs_size_mb", (vfs.f_blocks * vfs.f_bsize) / 1024 / 1024);
-            plong("fs_free_mb", (vfs.f_bfree * vfs.f_bsize) / 1024 / 1024);
-            plong("fs_used_mb", (vfs.f_blocks * vfs.f_bsize) / 1024 / 1024 - (vfs.f_bfree * vfs.f_bsize) / 1024 / 1024);
-            if (vfs.f_blocks > 0)
-                pdouble("fs_full_percent", ((double)vfs.f_blocks - (double)vfs.f_bfree) / (double)vfs.f_blocks * (double)100.0);
-            plong("fs_avail", (vfs.f_bavail * vfs.f_bsize) / 1024 / 1024);
-            plong("fs_files", vfs.f_files);
-            plong("fs_files_free", vfs.f_ffree);
-            plong("fs_namelength", vfs.f_namelen);
-            psubend();
+    psection("filesystems");
+    for (i = 0; i < filesystems_count; i++) {
+        fs = &filesystem[i];
+        psub(fs->fsname);
+        pstring("fs_dir", fs->dir);
+        pstring("fs_type", fs->type);
+        pstring("fs_opts", fs->opts);
+        pstring("fs_state", fs->hung ? "stale" : fs->err ? strerror(fs->err) : "ok");
+        if (fs->found) {
+            plong("fs_freqs", 0);
+            plong("fs_passno", 0);
+            plong("fs_bsize", fs->vfs.f_bsize);
+            plong("fs_size_mb", (fs->vfs.f_blocks * fs->vfs.f_bsize) / 1024 / 1024);
+            plong("fs_free_mb", (fs->vfs.f_bfree * fs->vfs.f_bsize) / 1024 / 1024);
+            plong("fs_used_mb", (fs->vfs.f_blocks * fs->vfs.f_bsize) / 1024 / 1024 - (fs->vfs.f_bfree * fs->vfs.f_bsize) / 1024 / 1024);
+            if (fs->vfs.f_blocks > 0)
+                pdouble("fs_full_percent", ((double)fs->vfs.f_blocks - (double)fs->vfs.f_bfree) / (double)fs->vfs.f_blocks * (double)100.0);
+            plong("fs_avail", (fs->vfs.f_bavail * fs->vfs.f_bsize) / 1024 / 1024);
+            plong("fs_files", fs->vfs.f_files);
+            plong("fs_files_free", fs->vfs.f_ffree);
+            plong("fs_namelength", fs->vfs.f_namelen);
         }
+        psubend();
     }
     psectionend();
-    endmntent(fp);
+    pthread_mutex_unlock(&filesystem_lock);
 }
 
 long power_timebase = 0;
@@ -2117,9 +5587,11 @@ void proc_cpuinfo()
 }
 
 /* Call this function AFTER proc_cpuinfo as it needs numbers from it */
-void sys_device_system_cpu(double elapsed, int print)
+void sys_device_system_cpu(int print)
 {
-    FILE* fp = 0;
+    static struct procfile* spurr_files = NULL; /* opened once per CPU, kept open */
+    static struct procfile* purr_files = NULL;
+    static int cpu_files = 0;
     char filename[1024];
     char line[1024];
     int i;
@@ -2134,6 +5606,8 @@ void sys_device_system_cpu(double elapsed, int print)
     static int switch_off = 0;
     static long long purr_saved = 0;
     static long long spurr_saved = 0;
+    static struct source_time stamp;
+    double elapsed;
 
     /* FUNCTION_START; */
     if (switch_off) {
@@ -2150,10 +5624,18 @@ void sys_device_system_cpu(double elapsed, int print)
     purr_total = 0;
 
     for (i = 0, finished = 0; finished == 0 && i < 192 * 8; i++) {
-        sprintf(filename, "/sys/devices/system/cpu/cpu%d/spurr", i);
+        if (i >= cpu_files) {
+            spurr_files = realloc(spurr_files, sizeof(struct procfile) * (i + 1));
+            purr_files = realloc(purr_files, sizeof(struct procfile) * (i + 1));
+            sprintf(filename, "/sys/devices/system/cpu/cpu%d/spurr", i);
+            spurr_files[i] = (struct procfile) { strdup(filename), -1 };
+            sprintf(filename, "/sys/devices/system/cpu/cpu%d/purr", i);
+            purr_files[i] = (struct procfile) { strdup(filename), -1 };
+            cpu_files = i + 1;
+        }
         if (debug)
-            printf("spurr file \"%s\"\n", filename);
-        if ((fp = fopen(filename, "r")) == NULL) {
+            printf("spurr file \"%s\"\n", spurr_files[i].filename);
+        if (procfile_read(&spurr_files[i]) < 0) {
             if (debug)
                 printf("spurr opened failed\n");
             if (i == 0) { /* failed on the 1st attempt then no spurr file = never try again */
@@ -2162,8 +5644,7 @@ void sys_device_system_cpu(double elapsed, int print)
             finished = 1;
             break;
         }
-        if (fgets(line, 1000, fp) != NULL) {
-            line[strlen(line) - 1] = 0;
+        if (procfile_gets(line, 1000, &spurr_files[i]) != NULL) {
             if (debug)
                 printf("spurr read \"%s\"\n", line);
             spurr_total += strtoll(line, NULL, 16);
@@ -2172,12 +5653,10 @@ void sys_device_system_cpu(double elapsed, int print)
                 printf("spurr read failed\n");
             finished = 1;
         }
-        fclose(fp);
 
-        sprintf(filename, "/sys/devices/system/cpu/cpu%d/purr", i);
         if (debug)
-            printf("purr file \"%s\"\n", filename);
-        if ((fp = fopen(filename, "r")) == NULL) {
+            printf("purr file \"%s\"\n", purr_files[i].filename);
+        if (procfile_read(&purr_files[i]) < 0) {
             if (debug)
                 printf("purr opened failed\n");
             if (i == 0) { /* failed on the 1st attempt then no purr file = never try again */
@@ -2186,8 +5665,7 @@ void sys_device_system_cpu(double elapsed, int print)
             finished = 1;
             break;
         }
-        if (fgets(line, 1000, fp) != NULL) {
-            line[strlen(line) - 1] = 0;
+        if (procfile_gets(line, 1000, &purr_files[i]) != NULL) {
             if (debug)
                 printf("purr read \"%s\"\n", line);
             purr_total += strtoll(line, NULL, 16);
@@ -2196,9 +5674,9 @@ void sys_device_system_cpu(double elapsed, int print)
                 printf("purr read failed\n");
             finished = 1;
         }
-        fclose(fp);
     }
 
+    elapsed = source_read(&stamp);
     if (print == PRINT_FALSE) {
         DEBUG printf("DEBUG: PRINT_FALSE\n");
         purr_saved = purr_total;
@@ -2211,6 +5689,7 @@ void sys_device_system_cpu(double elapsed, int print)
         return;
     } else {
         psection("sys_dev_sys_cpu");
+        pulong("sampled_at", stamp.now);
 
         pdelta = (double)(purr_total - purr_saved) / (double)power_timebase / elapsed;
         purr_saved = purr_total;
@@ -2340,12 +5819,14 @@ void identity(char* command, char* version)
 }
 
 #ifndef NOREMOTE
-void config(int debugging, long long maxloops, long seconds, int process_mode, int remote_mode, char* host, long port, char* secret)
+void config(int debugging, long long maxloops, long long unsigned interval, int process_mode, int remote_mode, char* host, long port, char* secret)
 {
 #else
-void config(int debugging, long long maxloops, long seconds, int process_mode)
+void config(int debugging, long long maxloops, long long unsigned interval, int process_mode)
 {
 #endif
+    int i;
+
     psection("config");
     pstring("debugging", debugging ? "yes" : "no");
     if (maxloops == -1) {
@@ -2353,8 +5834,33 @@ void config(int debugging, long long maxloops, long seconds, int process_mode)
     } else {
         plong("maxloops", maxloops);
     }
-    plong("seconds", seconds);
+    pdouble("seconds", interval / 1e9);
+    pulong("interval_nsec", interval);
+    psub("collector_period_nsec");
+    for (i = 0; i < COLLECTORS; i++)
+        if (collectors[i].enabled)
+            pulong(collectors[i].name, collectors[i].aggregate ? collectors[i].emit_period : collectors[i].period);
+    psubend();
+    if (aggregate_interval)
+        pulong("aggregate_interval_nsec", aggregate_interval);
+    if (collectors[COLLECTOR_CPU].enabled)
+    {
+        psub("cpu_rollup");
+        pstring("cpus", cpu_rollup & CPU_ROLLUP_CPUS ? "yes" : "no");
+        pstring("nodes", cpu_rollup & CPU_ROLLUP_NODES ? "yes" : "no");
+        pstring("sockets", cpu_rollup & CPU_ROLLUP_SOCKETS ? "yes" : "no");
+        if (cpu_rollup & CPU_ROLLUP_SUMMARY)
+            plong("summary_top", cpu_summary_top);
+        else
+            pstring("summary", "no");
+        psubend();
+    }
     pstring("process_mode", process_mode ? "yes" : "no");
+    pstring("output_format", cbor_mode ? "cbor" : "json");
+    pstring("positional", positional_mode ? "yes" : "no");
+    pstring("writer", writer_policies[writer_policy]);
+    if (writer_policy != WRITER_OFF)
+        plong("writer_slots", writer_slots);
 #ifndef NOREMOTE
     if (remote_mode) {
         psub("remote_mode");
@@ -2537,15 +6043,21 @@ int cpu_compare(const void* a, const void* b)
     return (int)(((struct topper*)b)->time - ((struct topper*)a)->time);
 }
 
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 16, 18)
+#define PROCSINFO_FIELDS 36 /* after the state */
+#else
+#define PROCSINFO_FIELDS 39
+#endif
+
 int proc_procsinfo(int pid, int index)
 {
-    FILE* fp;
     char filename[64];
+    char* pos;
+    long long fields[PROCSINFO_FIELDS];
     char buf[1024 * 4];
     int size = 0;
     int ret = 0;
     int count = 0;
-    int i;
     struct stat statbuf;
     struct passwd* pw;
 
@@ -2566,21 +6078,22 @@ int proc_procsinfo(int pid, int index)
     /* the statistic file for the process */
     snprintf(filename, 64, "/proc/%d/stat", pid);
 
-    if ((fp = fopen(filename, "r")) == NULL) {
-        fprintf(stderr, "ERROR: failed to open file %s", filename);
-        return 0;
-    }
-    size = fread(buf, 1, 1024 - 1, fp);
-    fclose(fp);
-    if (size == -1) {
+    if ((size = procfile_once(filename, buf, 1024)) == -1) {
         fprintf(stderr,
             "ERROR: procsinfo read returned = %d assuming process stopped pid=%d errno=%d\n",
             ret, pid, errno);
         return 0;
     }
-    ret = sscanf(buf, "%d (%s)", &p->procs[index].pi_pid, &p->procs[index].pi_comm[0]);
+    pos = buf;
+    fields[0] = 0;
+    ret = scan_number(pos, &fields[0]) != NULL;
+    p->procs[index].pi_pid = fields[0];
+    if ((pos = strchr(pos, '(')) != NULL) {
+        pos++;
+        ret += scan_word(&pos, p->procs[index].pi_comm, sizeof(p->procs[index].pi_comm));
+    }
     if (ret != 2) {
-        fprintf(stderr, "procsinfo sscanf returned = %d line=%s\n", ret, buf);
+        fprintf(stderr, "procsinfo scan returned = %d line=%s\n", ret, buf);
         return 0;
     }
     p->procs[index].pi_comm[strlen(p->procs[index].pi_comm) - 1] = 0;
@@ -2597,119 +6110,98 @@ int proc_procsinfo(int pid, int index)
     count++;
     count++;
 
-    ret = sscanf(&buf[count],
+    /* column 1 and 2 handled above */
+    p->procs[index].pi_state = buf[count]; /*3 numbers taken from "man proc" */
+    pos = &buf[count + 1];
+    ret = 1 + scan_numbers(&pos, fields, PROCSINFO_FIELDS);
+    p->procs[index].pi_ppid = fields[0]; /*4*/
+    p->procs[index].pi_pgrp = fields[1]; /*5*/
+    p->procs[index].pi_session = fields[2]; /*6*/
+    p->procs[index].pi_tty_nr = fields[3]; /*7*/
+    p->procs[index].pi_tty_pgrp = fields[4]; /*8*/
+    p->procs[index].pi_flags = fields[5]; /*9*/
+    p->procs[index].pi_minflt = fields[6]; /*10*/
+    p->procs[index].pi_child_min_flt = fields[7]; /*11*/
+    p->procs[index].pi_majflt = fields[8]; /*12*/
+    p->procs[index].pi_child_maj_flt = fields[9]; /*13*/
+    p->procs[index].pi_utime = fields[10]; /*14*/
+    p->procs[index].pi_stime = fields[11]; /*15*/
+    p->procs[index].pi_child_utime = fields[12]; /*16*/
+    p->procs[index].pi_child_stime = fields[13]; /*18*/
+    p->procs[index].pi_priority = fields[14]; /*19*/
+    p->procs[index].pi_nice = fields[15]; /*20*/
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 16, 18)
-        "%c %d %d %d %d %d %lu %lu %lu %lu %lu %lu %lu %ld %ld %ld %ld %ld %ld %lu %lu %ld %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %d %d",
+    p->procs[index].junk = fields[16]; /*21*/
 #else
-        /*                 1  2  3  4  5  6  7   8   9   10  11  12  13  14  15  16  17  18  19  20  21  22  23  24  25  26  27  28  29  30  31  32  33  34  35 36 37  38  39  40 */
-        "%c %d %d %d %d %d %lu %lu %lu %lu %lu %lu %lu %ld %ld %ld %ld %ld %ld %lu %lu %ld %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %d %d %lu %lu %llu",
+    p->procs[index].pi_num_threads = fields[16]; /*21*/
 #endif
-        /* column 1 and 2 handled above */
-        &p->procs[index].pi_state, /*3 numbers taken from "man proc" */
-        &p->procs[index].pi_ppid, /*4*/
-        &p->procs[index].pi_pgrp, /*5*/
-        &p->procs[index].pi_session, /*6*/
-        &p->procs[index].pi_tty_nr, /*7*/
-        &p->procs[index].pi_tty_pgrp, /*8*/
-        &p->procs[index].pi_flags, /*9*/
-        &p->procs[index].pi_minflt, /*10*/
-        &p->procs[index].pi_child_min_flt, /*11*/
-        &p->procs[index].pi_majflt, /*12*/
-        &p->procs[index].pi_child_maj_flt, /*13*/
-        &p->procs[index].pi_utime, /*14*/
-        &p->procs[index].pi_stime, /*15*/
-        &p->procs[index].pi_child_utime, /*16*/
-        &p->procs[index].pi_child_stime, /*18*/
-        &p->procs[index].pi_priority, /*19*/
-        &p->procs[index].pi_nice, /*20*/
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 16, 18)
-        &p->procs[index].junk, /*21*/
-#else
-        &p->procs[index].pi_num_threads, /*21*/
-#endif
-        &p->procs[index].pi_it_real_value, /*22*/
-        &p->procs[index].pi_start_time, /*23*/
-        &p->procs[index].pi_vsize, /*24*/
-        &p->procs[index].pi_rss, /*25*/
-        &p->procs[index].pi_rsslimit, /*26*/
-        &p->procs[index].pi_start_code, /*27*/
-        &p->procs[index].pi_end_code, /*28*/
-        &p->procs[index].pi_start_stack, /*29*/
-        &p->procs[index].pi_esp, /*29*/
-        &p->procs[index].pi_eip, /*30*/
-        &p->procs[index].pi_signal_pending, /*31*/
-        &p->procs[index].pi_signal_blocked, /*32*/
-        &p->procs[index].pi_signal_ignore, /*33*/
-        &p->procs[index].pi_signal_catch, /*34*/
-        &p->procs[index].pi_wchan, /*35*/
-        &p->procs[index].pi_swap_pages, /*36*/
-        &p->procs[index].pi_child_swap_pages, /*37*/
-        &p->procs[index].pi_signal_exit, /*38*/
-        &p->procs[index].pi_last_cpu /*39*/
+    p->procs[index].pi_it_real_value = fields[17]; /*22*/
+    p->procs[index].pi_start_time = fields[18]; /*23*/
+    p->procs[index].pi_vsize = fields[19]; /*24*/
+    p->procs[index].pi_rss = fields[20]; /*25*/
+    p->procs[index].pi_rsslimit = fields[21]; /*26*/
+    p->procs[index].pi_start_code = fields[22]; /*27*/
+    p->procs[index].pi_end_code = fields[23]; /*28*/
+    p->procs[index].pi_start_stack = fields[24]; /*29*/
+    p->procs[index].pi_esp = fields[25]; /*29*/
+    p->procs[index].pi_eip = fields[26]; /*30*/
+    p->procs[index].pi_signal_pending = fields[27]; /*31*/
+    p->procs[index].pi_signal_blocked = fields[28]; /*32*/
+    p->procs[index].pi_signal_ignore = fields[29]; /*33*/
+    p->procs[index].pi_signal_catch = fields[30]; /*34*/
+    p->procs[index].pi_wchan = fields[31]; /*35*/
+    p->procs[index].pi_swap_pages = fields[32]; /*36*/
+    p->procs[index].pi_child_swap_pages = fields[33]; /*37*/
+    p->procs[index].pi_signal_exit = fields[34]; /*38*/
+    p->procs[index].pi_last_cpu = fields[35]; /*39*/
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2, 16, 18)
-        ,
-        &p->procs[index].pi_realtime_priority, /*40*/
-        &p->procs[index].pi_sched_policy, /*41*/
-        &p->procs[index].pi_delayacct_blkio_ticks /*42*/
+    p->procs[index].pi_realtime_priority = fields[36]; /*40*/
+    p->procs[index].pi_sched_policy = fields[37]; /*41*/
+    p->procs[index].pi_delayacct_blkio_ticks = fields[38]; /*42*/
 #endif
-    );
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 16, 18)
     if (ret != 37) {
         fprintf(stderr,
-            "procsinfo2 sscanf wanted 37 returned = %d pid=%d line=%s\n", ret, pid, buf);
+            "procsinfo2 scan wanted 37 returned = %d pid=%d line=%s\n", ret, pid, buf);
         return 0;
     }
 #else
     if (ret != 40) {
         fprintf(stderr,
-            "procsinfo2 sscanf wanted 40 returned = %d pid=%d line=%s\n", ret, pid, buf);
+            "procsinfo2 scan wanted 40 returned = %d pid=%d line=%s\n", ret, pid, buf);
         return 0;
     }
 #endif
 
     snprintf(filename, 64, "/proc/%d/statm", pid);
-    if ((fp = fopen(filename, "r")) == NULL) {
-        fprintf(stderr, "failed to open file %s", filename);
-        return 0;
-    }
-    size = fread(buf, 1, 1024 * 4 - 1, fp);
-    fclose(fp); /* close it even if the read failed, the file could have been removed
-        between open & read i.e. the device driver does not behave like a file */
-    if (size == -1) {
+    if ((size = procfile_once(filename, buf, 1024 * 4)) == -1) {
         fprintf(stderr, "failed to read file %s", filename);
         return 0;
     }
 
-    ret = sscanf(&buf[0], "%lu %lu %lu %lu %lu %lu %lu",
-        &p->procs[index].statm_size,
-        &p->procs[index].statm_resident,
-        &p->procs[index].statm_share,
-        &p->procs[index].statm_trs,
-        &p->procs[index].statm_lrs,
-        &p->procs[index].statm_drs,
-        &p->procs[index].statm_dt);
+    pos = buf;
+    ret = scan_numbers(&pos, fields, 7);
+    p->procs[index].statm_size = fields[0];
+    p->procs[index].statm_resident = fields[1];
+    p->procs[index].statm_share = fields[2];
+    p->procs[index].statm_trs = fields[3];
+    p->procs[index].statm_lrs = fields[4];
+    p->procs[index].statm_drs = fields[5];
+    p->procs[index].statm_dt = fields[6];
     if (ret != 7) {
-        fprintf(stderr, "sscanf wanted 7 returned = %d line=%s\n", ret, buf);
+        fprintf(stderr, "scan wanted 7 returned = %d line=%s\n", ret, buf);
         return 0;
     }
     if (uid == (uid_t)0) {
         p->procs[index].read_io = 0;
         p->procs[index].write_io = 0;
         sprintf(filename, "/proc/%d/io", pid);
-        if ((fp = fopen(filename, "r")) != NULL) {
-            for (i = 0; i < 6; i++) {
-                if (fgets(buf, 1024, fp) == NULL) {
-                    break;
-                }
-                if (strncmp("read_bytes:", buf, 11) == 0)
-                    sscanf(&buf[12], "%llu", &p->procs[index].read_io);
-                if (strncmp("write_bytes:", buf, 12) == 0)
-                    sscanf(&buf[13], "%llu", &p->procs[index].write_io);
-            }
+        if (procfile_once(filename, buf, 1024 * 4) > 0) {
+            if ((pos = strstr(buf, "\nread_bytes:")) != NULL && scan_number(&pos[12], &fields[0]) != NULL)
+                p->procs[index].read_io = fields[0];
+            if ((pos = strstr(buf, "\nwrite_bytes:")) != NULL && scan_number(&pos[13], &fields[0]) != NULL)
+                p->procs[index].write_io = fields[0];
         }
-
-        if (fp != NULL)
-            fclose(fp);
     }
     return 1;
 }
@@ -2795,12 +6287,15 @@ void processes_space_manage()
 }
 
 /* initialise processor data structures */
+struct source_time processes_time;
+
 void processes_init()
 {
     /* allocate space for process records */
     processes_space_manage();
 
     /* fill the first set */
+    source_read(&processes_time);
     p->processes = getprocs(p->proc_records);
 }
 
@@ -2885,13 +6380,14 @@ void process_print(int entry, int max_sorted, int pagesize, double elapsed)
  * 2 build the topper structures of matching previous & current processes matched by pid
  * 3 save data for processes using over the threshold CPU percentage
  */
-void processes(pid_t monitor, double elapsed)
+void processes(pid_t monitor)
 {
     int pindex = 0;
     int qindex = 0;
     int entry = 0;
     int max_sorted = 0;
     long cputime;
+    double elapsed;
 #define pagesize (1024 * 4)
 
     /* swap databases note: q is previous and p is current */
@@ -2901,6 +6397,7 @@ void processes(pid_t monitor, double elapsed)
 
     /* recaculate the number of processes */
     processes_space_manage();
+    elapsed = source_read(&processes_time); /* as the scan starts */
 
     if (monitor == -1) {
         /* get fresh top processes data */
@@ -2946,6 +6443,7 @@ void processes(pid_t monitor, double elapsed)
     /* Even if we have no processes create a processors section + end
      * No proceses over the threadold is still valid JSON  - I hope.
      * */
+    pulong("processes_sampled_at", processes_time.now);
     parray("processes");
     for (entry = 0; entry < max_sorted; entry++) {
         process_print(entry, max_sorted, pagesize, elapsed);
@@ -2955,6 +6453,285 @@ void processes(pid_t monitor, double elapsed)
 
 /* --- Top Processes End --- */
 
+/* count the lines of a file, zero if it can not be read */
+long count_lines(char* filename)
+{
+    FILE* fp;
+    long lines = 0;
+    int ch;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+        return 0;
+    while ((ch = getc(fp)) != EOF)
+        if (ch == '\n')
+            lines++;
+    fclose(fp);
+    return lines;
+}
+
+/* Size the output arena from the enabled collectors and how many CPUs, disks,
+ * networks, mounts and processes the host has. The per item sizes are a
+ * generous JSON snapshot of each item and the total is doubled again so the
+ * arena should never grow once running.
+ */
+long output_arena_size(int cpu_mode, int mem_mode, int disk_mode, int net_mode, int filesystem_mode, int lpar_mode, int gpfs_mode, int proc_mode, int irq_mode, int cgroup_mode)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    long size;
+
+    size = 64 * 1024 + cpus * 640; /* identity, lscpu, timers and the cpuinfo section per processor */
+    if (cpu_mode)
+        size += cpus * 512;
+    if (mem_mode)
+        size += 32 * 1024; /* meminfo + vmstat */
+    if (disk_mode)
+        size += count_lines("/proc/diskstats") * 768;
+    if (net_mode)
+        size += count_lines("/proc/net/dev") * 1024 + 16 * 1024; /* + NFS */
+    if (filesystem_mode)
+        size += count_lines("/proc/mounts") * 1024;
+    if (lpar_mode)
+        size += 16 * 1024;
+    if (gpfs_mode)
+        size += 64 * 1024;
+    if (proc_mode)
+        size += getprocs(JUST_RETURN_THE_COUNT) * 1536;
+    if (irq_mode)
+        size += cpus * 64 * 2 + irq_top * 256 * 2; /* per CPU totals and the hottest of interrupts and softirqs */
+    if (cgroup_mode)
+        size += (cgroup_top > 0 && cgroup_top < cgroups ? cgroup_top : cgroups) * 1536;
+    size *= 2;
+    if (size < 1024 * 1024)
+        size = 1024 * 1024;
+    return size;
+}
+
+/* Called after the first snapshot is pushed: make sure there is twice its size
+ * in the arena, after this any growth is counted in output_reallocs */
+void output_arena_settle()
+{
+    if (output_high_water * 2 > output_size) {
+        output_size = output_high_water * 2;
+        output = realloc((void*)output, output_size);
+    }
+    output_steady = 1;
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*   collectors in parallel (-j threads)
+*    each due collector is a task, the pool threads take the next task with an
+*    atomic counter and write it to the collector's own section buffer (the p
+*    function state is per thread). Once every thread is done the sampler copies
+*    the buffers into output in the collector order so the output is the same
+*    as running them one after the other.
+*/
+pid_t monitor_pid = -1; /* -P pid or -1 for all */
+
+void collector_run(int i)
+{
+    long long unsigned start = nanomonotime();
+    long output_mark = output_char;
+    long schema_mark = schema_char;
+
+    if (collectors[i].aggregate) {
+        collectors[i].accumulators.next = 0;
+        aggregating = &collectors[i].accumulators;
+        aggregate_output = collectors[i].emit;
+    }
+    switch (i) {
+    case COLLECTOR_CPU:
+        proc_stat(PRINT_TRUE);
+        break;
+    case COLLECTOR_MEMORY:
+        proc_memory(PRINT_TRUE);
+        break;
+    case COLLECTOR_DISKS:
+        proc_diskstats(PRINT_TRUE);
+        break;
+    case COLLECTOR_NETWORKS:
+        proc_net_dev(PRINT_TRUE);
+        nfs();
+        break;
+    case COLLECTOR_UPTIME:
+        proc_uptime();
+        break;
+    case COLLECTOR_FILESYSTEMS:
+        filesystems();
+        break;
+    case COLLECTOR_LPAR:
+        read_lparcfg();
+        sys_device_system_cpu(PRINT_TRUE);
+        break;
+#ifndef NOGPFS
+    case COLLECTOR_GPFS:
+        gpfs_data();
+        break;
+#endif /* NOGPFS */
+    case COLLECTOR_PROCESSES:
+        processes(monitor_pid);
+        break;
+    case COLLECTOR_INTERRUPTS:
+        interrupts(PRINT_TRUE);
+        break;
+    case COLLECTOR_PRESSURE:
+        proc_pressure(PRINT_TRUE);
+        break;
+    case COLLECTOR_CGROUPS:
+        sys_fs_cgroup(PRINT_TRUE);
+        break;
+    }
+    if (aggregating != NULL) {
+        if (aggregate_output) /* what did not turn up this run is gone */
+            aggregating->used = aggregating->next;
+        aggregating = NULL;
+        if (!aggregate_output) { /* only the accumulators wanted this run */
+            output_char = output_mark;
+            if (output != NULL)
+                output[output_char] = 0;
+            schema_char = schema_mark;
+        }
+    }
+    histogram_record(&collectors[i].execute, nanomonotime() - start);
+}
+
+long pool_threads = 0;
+pthread_t* pool;
+sem_t pool_start; /* one post per thread per snapshot */
+sem_t pool_finished; /* one post per thread when there are no tasks left */
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+int pool_task[COLLECTORS];
+int pool_tasks;
+atomic_int pool_next;
+long pool_level; /* the sampler's p function state the sections start from */
+long pool_depth;
+int pool_counts[6]; /* the threads' precimon_stats counters */
+
+/* run collector i in this thread with its section buffer as output */
+void collector_task(int i)
+{
+    struct collector* c = &collectors[i];
+
+    output = c->section;
+    output_size = c->section_size;
+    output_char = 0;
+    schema = c->section_schema;
+    schema_size = c->section_schema_size;
+    schema_char = 0;
+    saved_level = pool_level;
+    positional_depth = pool_depth;
+
+    collector_run(i);
+
+    c->section = output;
+    c->section_size = output_size;
+    c->section_char = output_char;
+    c->section_schema = schema;
+    c->section_schema_size = schema_size;
+    c->section_schema_char = schema_char;
+}
+
+void* pool_main(void* arg)
+{
+    int task;
+
+    for (;;) {
+        sem_wait(&pool_start);
+        while ((task = atomic_fetch_add(&pool_next, 1)) < pool_tasks)
+            collector_task(pool_task[task]);
+        pthread_mutex_lock(&pool_lock);
+        pool_counts[0] += precimon_sections;
+        pool_counts[1] += precimon_subsections;
+        pool_counts[2] += precimon_string;
+        pool_counts[3] += precimon_long;
+        pool_counts[4] += precimon_double;
+        pool_counts[5] += precimon_hex;
+        pthread_mutex_unlock(&pool_lock);
+        precimon_sections = precimon_subsections = precimon_string = 0;
+        precimon_long = precimon_double = precimon_hex = 0;
+        sem_post(&pool_finished);
+    }
+    return NULL;
+}
+
+void pool_init()
+{
+    long i;
+
+    pool = malloc(sizeof(pthread_t) * pool_threads);
+    sem_init(&pool_start, 0, 0);
+    sem_init(&pool_finished, 0, 0);
+    for (i = 0; i < pool_threads; i++) {
+        if (pthread_create(&pool[i], NULL, pool_main, NULL) != 0) {
+            perror("precimon: collector thread pthread_create() failed, running the collectors one by one");
+            pool_threads = i;
+            return;
+        }
+    }
+}
+
+void pool_run()
+{
+    struct collector* c;
+    long i;
+
+    pool_tasks = 0;
+    for (i = 0; i < COLLECTORS; i++)
+        if (collectors[i].due)
+            pool_task[pool_tasks++] = i;
+    atomic_store(&pool_next, 0);
+    pool_level = saved_level;
+    pool_depth = positional_depth;
+
+    /* every thread waits for the next snapshot before this returns so a post is never left over */
+    for (i = 0; i < pool_threads; i++)
+        sem_post(&pool_start);
+    for (i = 0; i < pool_threads; i++)
+        sem_wait(&pool_finished);
+
+    for (i = 0; i < pool_tasks; i++) {
+        c = &collectors[pool_task[i]];
+        pneed(c->section_char);
+        memcpy(&output[output_char], c->section, c->section_char);
+        output_char += c->section_char;
+        output[output_char] = 0;
+        if (positional_depth >= 0) {
+            schema_check(c->section_schema_char);
+            memcpy(&schema[schema_char], c->section_schema, c->section_schema_char);
+            schema_char += c->section_schema_char;
+        }
+    }
+    precimon_sections += pool_counts[0];
+    precimon_subsections += pool_counts[1];
+    precimon_string += pool_counts[2];
+    precimon_long += pool_counts[3];
+    precimon_double += pool_counts[4];
+    precimon_hex += pool_counts[5];
+    memset(pool_counts, 0, sizeof(pool_counts));
+}
+
+void collectors_run()
+{
+    int i;
+
+    if (pool_threads > 0) {
+        pool_run();
+    } else {
+        for (i = 0; i < COLLECTORS; i++)
+            if (DUE(i))
+                collector_run(i);
+    }
+}
+
+/* sleep until there is something to output, the -a collectors sample on the way */
+void schedule_next()
+{
+    schedule_sleep();
+    while (!schedule_emits() && !interrupted) {
+        collectors_run();
+        schedule_sleep();
+    }
+}
+
 void hint(char* program, char* version)
 {
     FUNCTION_START;
@@ -2968,11 +6745,22 @@ void hint(char* program, char* version)
     printf("- Other options: -?\n");
     printf("\n");
     printf("\t-s seconds : seconds between snapshots of data (default 60 seconds)\n");
-    printf("\t-c count   : number of snapshots (default forever)\n\n");
+    printf("\t           : fractions like 0.5 or 250ms and 1500us work too (1ms at least), snapshots keep to start + k * interval\n");
+    printf("\t-c count   : number of snapshots (default forever)\n");
+    printf("\t-r collector=period,... : own period for cpu, memory, disks, networks, uptime, filesystems,\n");
+    printf("\t           : lpar, gpfs, processes, interrupts, pressure or cgroups e.g. -r cpu=100ms,disks=1,processes=30 (default the -s seconds)\n");
+    printf("\t-a interval : Sample CPU, disks and networks this often (e.g. 50ms) but output them at their\n");
+    printf("\t           : normal period as name_min, name_mean, name_max and name_p95 of the rates\n\n");
     printf("\t-m directory : Program will cd to the directory before output\n");
     printf("\t-f         : Output to file (not stdout) to two files below\n");
     printf("\t           : Data:  hostname_<year><month><day>_<hour><minutes>.json\n");
     printf("\t           : Error: hostname_<year><month><day>_<hour><minutes>.err\n");
+    printf("\t-B         : Output binary CBOR instead of JSON, precimon_decode converts it back to JSON\n");
+    printf("\t-w policy[,slots] : Write snapshots from a writer thread through a ring of slots (default 8)\n");
+    printf("\t           : when the ring is full policy is drop (oldest), block or spill (to a file)\n");
+    printf("\t-R priority : Real-time: SCHED_FIFO priority (1-99), memory locked and prefaulted, timer slack 1ns\n");
+    printf("\t-A cpus[:cpus] : Pin the sampler (and the -w writer thread to the second list) e.g. -A 3 or -A 2-3:0\n");
+    printf("\t-j threads : Run the collectors due in a snapshot in parallel on this many threads\n");
     printf("\t-d         : Switch on debugging\n");
     printf("\t-? or -h   : This output and stop\n");
 #ifndef NOREMOTE
@@ -2984,11 +6772,26 @@ void hint(char* program, char* version)
     printf("\t-P [pid]   : Add process stats for interesting process or a specific process identified by pid(take CPU cycles and large stats volume)\n");
     printf("\t-I percent : Set ignore process percent threshold (default 0.01%%)\n");
     printf("\t-C         : Output precimon configuration to the JSON file\n");
-    printf("\t-T         : Output snapshot timers e.g. sleep time, execution time\n");
+    printf("\t-K         : Positional snapshots: key schema once (and when it changes) then only values\n");
+    printf("\t-H count   : Every count snapshots output p50/p99/p99.9/max of the wake up overshoot, push\n");
+    printf("\t           : and collector execute times in nanoseconds since the last summary\n");
+    printf("\t-T         : Output snapshot timers e.g. sleep time, execution time, deadline lateness and missed deadlines\n");
     printf("\t-U         : CPU stats\n");
+    printf("\t-u list    : CPU stats per cpus, NUMA nodes and/or sockets e.g. -u nodes,sockets (default cpus)\n");
+    printf("\t           : or summary: min/median/p90/max and histogram across the CPUs plus the top=K busiest (default 8)\n");
     printf("\t-M         : Memory and Virtual Memory Stats\n");
+    printf("\t             vmstat event counters like pgfault are per second rates\n");
     printf("\t-D         : Disk I/O Stats per disk device\n");
+    printf("\t-b list    : Disk types: partitions, loop and dm, noloop and nodm leave them out (default loop,dm)\n");
     printf("\t-N         : Network device status and information\n");
+    printf("\t-o rules   : Which interfaces: glob, -glob leaves out, glob=name adds them up as name, ~ for a regex\n");
+    printf("\t           : e.g. -o -lo,veth*=veth (first match wins)\n");
+    printf("\t-Q count   : Interrupt and softirq rates per CPU and the count hottest IRQ/CPU pairs\n");
+    printf("\t-y         : Pressure stall information for CPU, memory and I/O\n");
+    printf("\t-Y list    : Extra snapshot when a trigger fires e.g. -Y memory=some:100ms/1s,io=full:200ms/2s\n");
+    printf("\t           : (cpu, memory or io = some or full : stall time / window of 500ms to 10s)\n");
+    printf("\t-g list    : cgroup v2 CPU, throttling, memory, I/O and pressure per cgroup: all or depth=N levels\n");
+    printf("\t           : and/or only the top=K by CPU e.g. -g depth=3,top=50\n");
     printf("\t-F         : Mounted File Systems Information\n");
     printf("\t-L         : IBM Power LPAR Data\n");
     printf("\t-G         : Global File System Stats\n");
@@ -3027,7 +6830,6 @@ int main(int argc, char** argv)
     char secret[256] = { 'O', 'x', 'd', 'e', 'a', 'd', 'b', 'e', 'e', 'f', 0 };
     long long loop;
     long long maxloops = -1;
-    long seconds = 60;
 #ifndef NOREMOTE
     long port = -1;
     char host[1024 + 1] = { 0 };
@@ -3040,9 +6842,6 @@ int main(int argc, char** argv)
     long long unsigned execute_start = 0;
     long long unsigned execute_end = 0;
     long long unsigned execute_time = 0;
-    long long unsigned sleep_nanoseconds;
-    long unsigned sleep_seconds;
-    double elapsed;
     int commlen;
     int i;
     int file_output = 0;
@@ -3057,9 +6856,12 @@ int main(int argc, char** argv)
     char datastring[256];
 #endif
     pid_t childpid;
-    pid_t monitor_process = -1;
     int proc_mode = 0;
+    int irq_mode = 0;
+    int pressure_mode = 0;
+    int cgroup_mode = 0;
     int timers_mode = 0;
+    long reader_syscalls = 0; /* procfile_syscalls when the snapshot started */
     int cpu_mode = 0;
     int mem_mode = 0;
     int disk_mode = 0;
@@ -3087,7 +6889,7 @@ int main(int argc, char** argv)
 
     uid = getuid();
 
-    while (-1 != (ch = getopt(argc, argv, "?hfm:s:c:di:I:P:p:X:xCTUMDNLG"))) {
+    while (-1 != (ch = getopt(argc, argv, "?hfm:s:c:di:j:a:A:H:I:P:p:r:R:X:xu:w:Q:b:o:yY:g:BCKTUMDNFLG"))) {
         switch (ch) {
         case '?':
         case 'h':
@@ -3102,13 +6904,26 @@ int main(int argc, char** argv)
             directory[4096] = 0;
             break;
         case 's':
-            seconds = atoi(optarg);
-            if (seconds < 1)
-                seconds = 1;
+            if ((snapshot_interval = interval_parse(optarg)) == 0) {
+                printf("%s -s %s: the interval should be seconds or end with ms or us, and be 1ms at least\n", argv[0], optarg);
+                exit(55);
+            }
             break;
         case 'c':
             maxloops = atoi(optarg);
             break;
+        case 'a':
+            if ((aggregate_interval = interval_parse(optarg)) == 0) {
+                printf("%s -a %s: the interval should be seconds or end with ms or us, and be 1ms at least\n", argv[0], optarg);
+                exit(55);
+            }
+            break;
+        case 'r':
+            if ((s = collector_periods(optarg)) != NULL) {
+                printf("%s -r: %s should be one of cpu, memory, disks, networks, uptime, filesystems, lpar, gpfs, processes, interrupts, pressure or cgroups=period\n", argv[0], s);
+                exit(56);
+            }
+            break;
         case 'd':
             debug++;
             break;
@@ -3128,18 +6943,100 @@ int main(int argc, char** argv)
         case 'P':
             proc_mode = 1;
             if (optarg != NULL) {
-                monitor_process = atoi(optarg);
+                monitor_pid = atoi(optarg);
             }
             break;
         case 'I':
             ignore_threshold = atof(optarg);
             break;
+        case 'H':
+            histogram_every = atol(optarg);
+            break;
+        case 'j':
+            pool_threads = atol(optarg);
+            if (pool_threads < 0 || pool_threads > COLLECTORS)
+                pool_threads = COLLECTORS;
+            break;
+        case 'o':
+            if ((s = net_rules_parse(optarg)) != NULL) {
+                printf("%s -o: %s should be glob, +glob, -glob or glob=name with ~regex for a regular expression\n", argv[0], s);
+                exit(61);
+            }
+            break;
+        case 'b':
+            if (!disk_types_parse(optarg)) {
+                printf("%s -b: should be a list of partitions, loop, dm, nopartitions, noloop and nodm\n", argv[0]);
+                exit(60);
+            }
+            break;
+        case 'y':
+            pressure_mode = 1;
+            break;
+        case 'Y':
+            pressure_mode = 1;
+            if ((s = pressure_triggers_parse(optarg)) != NULL) {
+                printf("%s -Y: %s should be cpu, memory or io=some or full:stall/window with a window of 500ms to 10s\n", argv[0], s);
+                exit(62);
+            }
+            break;
+        case 'g':
+            cgroup_mode = 1;
+            if (!cgroup_options_parse(optarg)) {
+                printf("%s -g: should be all or a list of depth=N and top=K\n", argv[0]);
+                exit(63);
+            }
+            break;
+        case 'Q':
+            irq_mode = 1;
+            irq_top = atol(optarg);
+            if (irq_top < 0)
+                irq_top = 0;
+            break;
+        case 'u':
+            if (!cpu_rollup_parse(optarg)) {
+                printf("%s -u: should be a list of cpus, nodes, sockets, summary and top=K\n", argv[0]);
+                exit(59);
+            }
+            break;
+        case 'R':
+            realtime_priority = atoi(optarg);
+            if (realtime_priority < sched_get_priority_min(SCHED_FIFO) || realtime_priority > sched_get_priority_max(SCHED_FIFO)) {
+                printf("%s -R %s: the priority should be %d to %d\n", argv[0], optarg,
+                    sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+                exit(57);
+            }
+            break;
+        case 'A':
+            if (!affinity_parse(optarg)) {
+                printf("%s -A %s: should be a CPU list like 2 or 0-3,8 then optionally :CPU list for the writer\n", argv[0], optarg);
+                exit(58);
+            }
+            break;
         case 'x':
             print_child_pid = 1;
             break;
+        case 'B':
+            cbor_mode = 1;
+            break;
+        case 'w':
+            for (i = WRITER_DROP; i <= WRITER_SPILL; i++)
+                if (strcspn(optarg, ",") == strlen(writer_policies[i]) && !strncmp(optarg, writer_policies[i], strlen(writer_policies[i])))
+                    writer_policy = i;
+            if (writer_policy == WRITER_OFF) {
+                printf("%s -w %s: the policy should be drop, block or spill\n", argv[0], optarg);
+                exit(54);
+            }
+            if ((s = strchr(optarg, ',')) != NULL)
+                writer_slots = atol(s + 1);
+            if (writer_slots < 1)
+                writer_slots = 1;
+            break;
         case 'C':
             config_mode = 1;
             break;
+        case 'K':
+            positional_mode = 1;
+            break;
         case 'T':
             timers_mode = 1;
             break;
@@ -3224,13 +7121,14 @@ int main(int argc, char** argv)
         get_hostname();
         get_time();
         get_localtime();
-        sprintf(filename, "%s_%02d%02d%02d_%02d%02d.json",
+        sprintf(filename, "%s_%02d%02d%02d_%02d%02d.%s",
             shorthostname,
             tim->tm_year,
             tim->tm_mon,
             tim->tm_mday,
             tim->tm_hour,
-            tim->tm_min);
+            tim->tm_min,
+            cbor_mode ? "cbor" : "json");
 
         if ((fp = freopen(filename, "w", stdout)) == 0) {
             perror("opening file for stdout");
@@ -3275,8 +7173,29 @@ int main(int argc, char** argv)
         signal(SIGHUP, SIG_IGN); /* ignore hangups */
     }
 
-    output_size = 1024 * 1024;
+    collectors[COLLECTOR_CPU].enabled = cpu_mode;
+    collectors[COLLECTOR_MEMORY].enabled = mem_mode;
+    collectors[COLLECTOR_DISKS].enabled = disk_mode;
+    collectors[COLLECTOR_NETWORKS].enabled = net_mode;
+    collectors[COLLECTOR_FILESYSTEMS].enabled = filesystem_mode;
+    collectors[COLLECTOR_LPAR].enabled = lpar_mode;
+    collectors[COLLECTOR_GPFS].enabled = gpfs_mode;
+    collectors[COLLECTOR_PROCESSES].enabled = proc_mode;
+    collectors[COLLECTOR_INTERRUPTS].enabled = irq_mode;
+    collectors[COLLECTOR_PRESSURE].enabled = pressure_mode;
+    if (cgroup_mode && !cgroup_init()) {
+        fprintf(stderr, "%s -g: there is no cgroup v2 hierarchy at /sys/fs/cgroup or /sys/fs/cgroup/unified\n", argv[0]);
+        cgroup_mode = 0;
+    }
+    collectors[COLLECTOR_CGROUPS].enabled = cgroup_mode;
+
+    output_size = output_arena_size(cpu_mode, mem_mode, disk_mode, net_mode, filesystem_mode, lpar_mode, gpfs_mode, proc_mode, irq_mode, cgroup_mode);
     output = malloc(output_size); /* buffer space for the stats before the push to standard output */
+    if (writer_policy != WRITER_OFF)
+        writer_start();
+    realtime_start(); /* after the writer is going so it keeps the default scheduler */
+    if (pool_threads > 0)
+        pool_init(); /* after realtime_start() so the collector threads run like the sampler */
     commlen = 1; /* for the terminating zero */
     for (i = 0; i < argc; i++) {
         commlen = commlen + strlen(argv[i]) + 1; /* +1 for spaces */
@@ -3290,21 +7209,25 @@ int main(int argc, char** argv)
     }
 
     execute_start = nanomonotime();
+    schedule_init(); /* the counters are seeded now */
     /* seed incrementing counters */
     if (cpu_mode)
-        proc_stat(0, PRINT_FALSE);
+        proc_stat(PRINT_FALSE);
+
+    if (mem_mode)
+        proc_memory(PRINT_FALSE);
 
     if (disk_mode)
-        proc_diskstats(0, PRINT_FALSE);
+        proc_diskstats(PRINT_FALSE);
 
     if (net_mode) {
-        proc_net_dev(0, PRINT_FALSE);
+        proc_net_dev(PRINT_FALSE);
         nfs_init();
     }
 
     if (lpar_mode) {
         init_lparcfg();
-        sys_device_system_cpu(1.0, PRINT_FALSE);
+        sys_device_system_cpu(PRINT_FALSE);
     }
 #ifndef NOGPFS
     if (gpfs_mode) {
@@ -3314,6 +7237,14 @@ int main(int argc, char** argv)
     if (proc_mode) {
         processes_init();
     }
+    if (irq_mode)
+        interrupts(PRINT_FALSE);
+
+    if (pressure_mode)
+        proc_pressure(PRINT_FALSE);
+
+    if (cgroup_mode)
+        sys_fs_cgroup(PRINT_FALSE);
 
     /* pre-amble */
     pstart();
@@ -3321,9 +7252,9 @@ int main(int argc, char** argv)
 
     if (config_mode) {
 #ifndef NOREMOTE
-        config(debug, maxloops, seconds, proc_mode, hostmode, hostname, port, secret);
+        config(debug, maxloops, snapshot_interval, proc_mode, hostmode, hostname, port, secret);
 #else
-        config(debug, maxloops, seconds, proc_mode);
+        config(debug, maxloops, snapshot_interval, proc_mode);
 #endif
     }
 
@@ -3337,16 +7268,12 @@ int main(int argc, char** argv)
     execute_end = nanomonotime();
 
 #define EXECUTE_TIME (execute_time = execute_end - execute_start)
-#define SLEEP_SECONDS (sleep_seconds = sleep_nanoseconds != 0 && sleep_nanoseconds < 1e9 ? seconds - 1 : seconds - (long)(execute_time / 1e9))
-#define SLEEP_NANOSECONDS (sleep_nanoseconds = execute_time == 0 ? 0 : (long)(1e9 - (execute_time % (long)1e9)))
 
     EXECUTE_TIME;
-    SLEEP_NANOSECONDS;
-    SLEEP_SECONDS;
 
-    sleep_start = nanomonotime();
-    nanomonosleep(sleep_seconds, sleep_nanoseconds);
-    sleep_end = nanomonotime();
+    sleep_start = nanoschedtime();
+    schedule_next();
+    sleep_end = nanoschedtime();
     sleep_time = sleep_end - sleep_start;
 
     for (loop = 0; maxloops == -1 || loop <= maxloops; loop++) {
@@ -3355,59 +7282,44 @@ int main(int argc, char** argv)
         if (loop != 0) {
             if (timers_mode) {
                 psection("timers");
-                pulong("decided_sleep_time", sleep_seconds * 1e9 + sleep_nanoseconds);
+                pulong("decided_sleep_time", deadline > sleep_start ? deadline - sleep_start : 0);
                 pulong("actual_sleep_time", sleep_time);
                 pulong("execute_time", execute_time);
+                pulong("deadline_lateness", deadline_lateness);
+                pulong("deadline_lateness_max", deadline_lateness_max);
+                pulong("deadlines_missed", deadlines_missed);
+                pdouble("deadline_jitter", deadline_jitter);
+                if (realtime_priority || realtime_affinity)
+                    realtime_state();
+                plong("output_high_water", output_high_water);
+                plong("output_reallocs", output_reallocs);
+                plong("reader_syscalls", atomic_load(&procfile_syscalls) - reader_syscalls);
+                if (writer_policy != WRITER_OFF) {
+                    plong("writer_queued_bytes", writer_queued_bytes);
+                    plong("writer_dropped_bytes", writer_dropped_bytes);
+                    plong("writer_stalled_bytes", writer_stalled_bytes);
+                }
                 psectionend();
             }
+            if (histogram_every > 0 && loop % histogram_every == 0)
+                latency();
             parrayelementend(loop == maxloops);
             push();
+            if (loop == 1)
+                output_arena_settle();
         }
 
         if (loop == maxloops) {
             break;
         }
 
-        DEBUG pulong("elapsed", sleep_time);
         DEBUG praw("Snapshot");
+        reader_syscalls = atomic_load(&procfile_syscalls);
 
-        elapsed = sleep_time * 1e-9;
-
+        /* each collector works out its rates over the time since it last ran */
         parrayelement();
         snapshot_info(loop);
-        if (cpu_mode)
-            proc_stat(elapsed, PRINT_TRUE);
-
-        if (mem_mode) {
-            read_data_number("meminfo");
-            read_data_number("vmstat");
-        }
-
-        if (disk_mode)
-            proc_diskstats(elapsed, PRINT_TRUE);
-
-        if (net_mode) {
-            proc_net_dev(elapsed, PRINT_TRUE);
-            nfs(elapsed);
-        }
-
-        proc_uptime();
-
-        if (filesystem_mode)
-            filesystems();
-
-        if (lpar_mode) {
-            read_lparcfg(elapsed);
-            sys_device_system_cpu(elapsed, PRINT_TRUE);
-        }
-#ifndef NOGPFS
-        if (gpfs_mode) {
-            gpfs_data(elapsed);
-        }
-#endif /* NOGPFS */
-        if (proc_mode) {
-            processes(monitor_process, elapsed);
-        }
+        collectors_run();
 
         if (interrupted) {
             fprintf(stderr, "signal=%d received at loop=%lld, breaking and exiting gracefully...\n", interrupted, loop);
@@ -3417,13 +7329,10 @@ int main(int argc, char** argv)
         execute_end = nanomonotime();
         EXECUTE_TIME;
         if (maxloops != 1 && loop != maxloops) {
-            SLEEP_NANOSECONDS;
-            SLEEP_SECONDS;
-
-            DEBUG printf("loop=%lld, nanomonosleep(%lu, %llu) . . .\n", loop, sleep_seconds, sleep_nanoseconds);
-            sleep_start = nanomonotime();
-            nanomonosleep(sleep_seconds, sleep_nanoseconds);
-            sleep_end = nanomonotime();
+            DEBUG printf("loop=%lld, schedule_sleep() . . .\n", loop);
+            sleep_start = nanoschedtime();
+            schedule_next();
+            sleep_end = nanoschedtime();
             sleep_time = sleep_end - sleep_start;
         }
     }
@@ -3435,5 +7344,7 @@ int main(int argc, char** argv)
 
     pfinish();
     push();
+    if (writer_policy != WRITER_OFF)
+        writer_finish();
     return 0;
 }
@@ -23,6 +23,10 @@
 #define ERROR      42
 #define LOG        44
 
+/* precimon -B output starts with the CBOR self-describe tag 55799 */
+#define CBOR_MAGIC "\xd9\xd9\xf7"
+#define CBOR_MAGIC_LENGTH 3
+
 #define SECRET_LENGTH 256
 char local_secret[SECRET_LENGTH] = {"Oxdeadbeef"};
 char injector_command[4096] = {"/usr/local/bin/injector.py"};
@@ -156,7 +160,7 @@ void identify(size_t read, char* printbuffer, char* buffer, char* preamble, char
     }
 
     /* no checks for preamble and postamble as they are random */
-    if(strncmp(utc, "201", 3) ) /* works until 2020 year */
+    if(strncmp(utc, "20", 2) ) /* works until 2100 year */
         logger(ERROR, "Missing year in request", buffer, -1);
 
     if(strncmp(remote_secret, local_secret, sizeof(local_secret)) )
@@ -169,9 +173,11 @@ void identify(size_t read, char* printbuffer, char* buffer, char* preamble, char
 /* this is a child precimon_collector server process, so we can exit on errors */
 void child(int fd, FILE *pop, int save_json)
 {
-    int json_file_fd, bytes;
+    int json_file_fd = -1, bytes;
     int loops = 0;
+    int cbor = 0;
     long ret;
+    long more;
     char buffer[BUFSIZE + 1];
     char printbuffer[BUFSIZE + 1];
 
@@ -193,22 +199,35 @@ void child(int fd, FILE *pop, int save_json)
 
     identify(ret, printbuffer, buffer, preamble, name, hostname, utc, remote_secret, version, postamble);
 
-    /* open the file for writing to save the JSON data*/
-    if(save_json) {
-        sprintf(printbuffer, "%s-%s.json", hostname, utc);
-        if((json_file_fd = open(printbuffer, O_CREAT | O_WRONLY, 0644)) == -1) {
-            logger(ERROR, "Failed to open file for writing, returned", hostname, json_file_fd);
-        }
-        logger(LOG, "opened", buffer, -1);
-    } else{
+    if(!save_json)
         logger(LOG, "not opening the JSON output file as requested", buffer, -1);
-    }
 
     do {
         ret = read(fd, buffer, BUFSIZE);
 
         if(ret > 0) {
             loops++;
+            if(loops == 1) {
+                /* the first data tells us if precimon sends JSON or binary CBOR, a short TCP read may cut the tag */
+                while(ret < CBOR_MAGIC_LENGTH && (more = read(fd, &buffer[ret], BUFSIZE - ret)) > 0)
+                    ret += more;
+                if(ret >= CBOR_MAGIC_LENGTH && !memcmp(buffer, CBOR_MAGIC, CBOR_MAGIC_LENGTH)) {
+                    cbor = 1;
+                    if(pop) {
+                        logger(LOG, "injector needs JSON, not injecting this binary CBOR data", hostname, -1);
+                        pop = NULL;
+                    }
+                }
+
+                /* open the file for writing to save the data*/
+                if(save_json) {
+                    sprintf(printbuffer, "%s-%s.%s", hostname, utc, cbor ? "cbor" : "json");
+                    if((json_file_fd = open(printbuffer, O_CREAT | O_WRONLY, 0644)) == -1) {
+                        logger(ERROR, "Failed to open file for writing, returned", hostname, json_file_fd);
+                    }
+                    logger(LOG, "opened", printbuffer, -1);
+                }
+            }
             if(save_json) {
                 /*logger(LOG, "Bytes read from socket, returned bytes",hostname,ret);*/
                 if((bytes = write(json_file_fd, buffer, ret)) == -1) {
@@ -250,7 +269,8 @@ void hint(char *command)
 #endif
     , command, command, VERSION, PROTOCOL_VERSION);
     printf(
-    "By default, collector saves the data to a file named hostname+date+time.json to the supplied directory.\n\n"
+    "By default, collector saves the data to a file named hostname+date+time.json to the supplied directory.\n"
+    "Binary output from precimon -B is saved as hostname+date+time.cbor, use precimon_decode to get JSON.\n\n"
     "\t-d      Directory to save JSON file.\n"
     "\t-p      TCP port to listen for connections on.\n"
     "\t-X      Connection password.\n"
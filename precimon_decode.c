@@ -0,0 +1,455 @@
+/*
+ * precimon_decode.c -- converts precimon binary (CBOR, precimon -B) output back to precimon JSON
+ * Developer: Jalal Mostafa.
+ * (C) Copyright 2019 Jalal Mostafa
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#define VERSION "0.1"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CBOR_UNSIGNED 0
+#define CBOR_NEGATIVE 1
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_TAG 6
+#define CBOR_SIMPLE 7
+#define CBOR_INDEFINITE 31
+#define CBOR_BREAK 0xff
+#define CBOR_FLOAT32 0xfa
+#define CBOR_FLOAT64 0xfb
+#define CBOR_TAG_BASE16 23
+#define CBOR_TAG_SELF_DESCRIBE 55799
+
+FILE* in;
+FILE* out;
+long long in_offset = 0;
+
+/* JSON is built in this buffer exactly the way precimon does it, so the
+ * trailing "," can be removed before an entry is closed */
+char* output;
+long output_size = 0;
+long output_char = 0;
+long saved_level = 1;
+
+void error(char* msg)
+{
+    fprintf(stderr, "precimon_decode: %s at byte %lld\n", msg, in_offset);
+    exit(1);
+}
+
+/* keep room for len more characters */
+void reserve(long len)
+{
+    if (output_char + len + 1 > output_size) {
+        output_size = output_char + len + 1 + 1024 * 1024;
+        if ((output = realloc(output, output_size)) == NULL)
+            error("out of memory");
+    }
+}
+
+/* write out all but the last two characters as they may still be a "," to remove */
+void flush()
+{
+    if (output_char <= 2)
+        return;
+    if (fwrite(output, 1, output_char - 2, out) != (size_t)(output_char - 2))
+        error("write failed");
+    memmove(output, &output[output_char - 2], 2);
+    output_char = 2;
+}
+
+void praw(char* string)
+{
+    long len = strlen(string);
+
+    reserve(len);
+    memcpy(&output[output_char], string, len + 1);
+    output_char += len;
+}
+
+void indent()
+{
+    long i;
+
+    for (i = 0; i < saved_level; i++)
+        praw("\t");
+}
+
+void remove_ending_comma_if_any()
+{
+    if (output_char >= 2 && output[output_char - 2] == ',') {
+        output[output_char - 2] = '\n';
+        output_char--;
+    }
+}
+
+/* the same layout as the precimon p functions */
+void psection(char* name)
+{
+    indent();
+    reserve(strlen(name) + 8);
+    output_char += sprintf(&output[output_char], "\"%s\": {\n", name);
+    saved_level++;
+}
+
+void psectionend()
+{
+    saved_level--;
+    remove_ending_comma_if_any();
+    indent();
+    praw("},\n");
+}
+
+void parray(char* name)
+{
+    indent();
+    reserve(strlen(name) + 8);
+    output_char += sprintf(&output[output_char], "\"%s\": [", name);
+}
+
+void parrayend()
+{
+    if (output_char >= 1 && output[output_char - 1] == ',')
+        output_char--;
+    praw("],\n");
+}
+
+void parrayelement()
+{
+    praw("{\n");
+    saved_level++;
+}
+
+void parrayelementend()
+{
+    remove_ending_comma_if_any();
+    saved_level--;
+    indent();
+    praw("},"); /* parrayend() removes the last comma */
+}
+
+void pvalue(char* name, char* format, ...)
+{
+    va_list ap;
+    long len;
+
+    indent();
+    reserve(strlen(name) + 8);
+    output_char += sprintf(&output[output_char], "\"%s\": ", name);
+    va_start(ap, format);
+    len = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+    reserve(len + 2);
+    va_start(ap, format);
+    output_char += vsprintf(&output[output_char], format, ap);
+    va_end(ap);
+    praw(",\n");
+}
+
+/* - - - CBOR reading - - - */
+
+int next_byte()
+{
+    int ch;
+
+    if ((ch = getc(in)) == EOF)
+        error("unexpected end of input");
+    in_offset++;
+    return ch;
+}
+
+long long unsigned argument(int info)
+{
+    long long unsigned value = 0;
+    int bytes;
+
+    if (info < 24)
+        return info;
+    switch (info) {
+    case 24:
+        bytes = 1;
+        break;
+    case 25:
+        bytes = 2;
+        break;
+    case 26:
+        bytes = 4;
+        break;
+    case 27:
+        bytes = 8;
+        break;
+    default:
+        error("unsupported CBOR argument");
+        return 0;
+    }
+    while (bytes-- > 0)
+        value = (value << 8) | next_byte();
+    return value;
+}
+
+/* read a definite length text string into a malloc()ed string */
+char* text(int head)
+{
+    long long unsigned len;
+    char* string;
+
+    if ((head >> 5) != CBOR_TEXT)
+        error("expected a text string");
+    len = argument(head & 0x1f);
+    if ((string = malloc(len + 1)) == NULL)
+        error("out of memory");
+    if (fread(string, 1, len, in) != len)
+        error("truncated text string");
+    in_offset += len;
+    string[len] = 0;
+    return string;
+}
+
+void map(char* name);
+void array(char* name);
+void item(char* name);
+
+/* - - - positional snapshots (precimon -K) - - -
+ * "schema" lists the p function calls and stays in force until the next one
+ * "values" holds just the values in schema order
+ */
+char** schema = NULL;
+long schema_tokens = 0;
+
+void schema_read()
+{
+    int head;
+    long i;
+
+    if (next_byte() != ((CBOR_ARRAY << 5) | CBOR_INDEFINITE))
+        error("expected the schema array");
+    for (i = 0; i < schema_tokens; i++)
+        free(schema[i]);
+    schema_tokens = 0;
+    while ((head = next_byte()) != CBOR_BREAK) {
+        if ((schema = realloc(schema, sizeof(char*) * (schema_tokens + 1))) == NULL)
+            error("out of memory");
+        schema[schema_tokens++] = text(head);
+    }
+}
+
+void values_expand()
+{
+    char* open = NULL; /* what each "}" or "]" closes: Section, array Element or Array */
+    long depth = 0;
+    long i;
+    char* token;
+
+    if (schema == NULL)
+        error("values without a schema");
+    if (next_byte() != ((CBOR_ARRAY << 5) | CBOR_INDEFINITE))
+        error("expected the values array");
+    if ((open = malloc(schema_tokens + 1)) == NULL)
+        error("out of memory");
+    for (i = 0; i < schema_tokens; i++) {
+        token = schema[i];
+        if (token[0] == '{' && token[1] != 0) {
+            psection(&token[1]);
+            open[depth++] = 'S';
+        } else if (token[0] == '{') {
+            parrayelement();
+            open[depth++] = 'E';
+        } else if (token[0] == '[') {
+            parray(&token[1]);
+            open[depth++] = 'A';
+        } else if (token[0] == '}' || token[0] == ']') {
+            if (depth == 0)
+                error("unbalanced schema");
+            switch (open[--depth]) {
+            case 'S':
+                psectionend();
+                break;
+            case 'E':
+                parrayelementend();
+                break;
+            case 'A':
+                parrayend();
+                break;
+            }
+        } else {
+            item(token);
+        }
+    }
+    free(open);
+    if (next_byte() != CBOR_BREAK)
+        error("more values than the schema names");
+}
+
+/* one "name": value pair */
+void item(char* name)
+{
+    int head = next_byte();
+    int info = head & 0x1f;
+    long long unsigned value;
+    char* string;
+    union {
+        float f;
+        uint32_t u;
+    } f32;
+    union {
+        double d;
+        uint64_t u;
+    } f64;
+
+    switch (head >> 5) {
+    case CBOR_UNSIGNED:
+        pvalue(name, "%llu", argument(info));
+        break;
+    case CBOR_NEGATIVE:
+        value = argument(info);
+        pvalue(name, "%lld", -1 - (long long)value);
+        break;
+    case CBOR_TEXT:
+        string = text(head);
+        pvalue(name, "\"%s\"", string);
+        free(string);
+        break;
+    case CBOR_ARRAY:
+        if (info != CBOR_INDEFINITE)
+            error("expected an indefinite length array");
+        array(name);
+        break;
+    case CBOR_MAP:
+        if (info != CBOR_INDEFINITE)
+            error("expected an indefinite length map");
+        psection(name);
+        map(name);
+        psectionend();
+        break;
+    case CBOR_TAG:
+        if (argument(info) != CBOR_TAG_BASE16)
+            error("unsupported tag");
+        head = next_byte();
+        if ((head >> 5) != CBOR_UNSIGNED)
+            error("base16 tag without an unsigned integer");
+        pvalue(name, "\"0x%08llx\"", argument(head & 0x1f));
+        break;
+    case CBOR_SIMPLE:
+        if (head == CBOR_FLOAT32) {
+            f32.u = (uint32_t)argument(info);
+            pvalue(name, "%.3f", (double)f32.f);
+        } else if (head == CBOR_FLOAT64) {
+            f64.u = argument(info);
+            pvalue(name, "%.3f", f64.d);
+        } else
+            error("unsupported simple value");
+        break;
+    default:
+        error("unsupported CBOR major type");
+    }
+}
+
+/* pairs until the break byte */
+void map(char* name)
+{
+    int head;
+    char* key;
+
+    while ((head = next_byte()) != CBOR_BREAK) {
+        key = text(head);
+        if (!strcmp(key, "schema"))
+            schema_read();
+        else if (!strcmp(key, "values"))
+            values_expand();
+        else
+            item(key);
+        free(key);
+    }
+}
+
+/* arrays hold maps: the snapshots and the processes */
+void array(char* name)
+{
+    int head;
+
+    parray(name);
+    while ((head = next_byte()) != CBOR_BREAK) {
+        if (head != ((CBOR_MAP << 5) | CBOR_INDEFINITE))
+            error("expected an array of maps");
+        parrayelement();
+        map(name);
+        parrayelementend();
+        flush();
+    }
+    parrayend();
+}
+
+void decode()
+{
+    int head;
+    char* key;
+
+    head = next_byte();
+    if ((head >> 5) == CBOR_TAG) {
+        if (argument(head & 0x1f) != CBOR_TAG_SELF_DESCRIBE)
+            error("not precimon CBOR output");
+        head = next_byte();
+    }
+    if (head != ((CBOR_MAP << 5) | CBOR_INDEFINITE))
+        error("not precimon CBOR output");
+
+    praw("{\n");
+    while ((head = next_byte()) != CBOR_BREAK) {
+        key = text(head);
+        item(key);
+        free(key);
+        flush();
+    }
+    remove_ending_comma_if_any();
+    praw("}\n");
+}
+
+void hint(char* command)
+{
+    printf("%s [file.cbor]\n\n"
+           "precimon_decode version=%s converts the binary output of precimon -B back to precimon JSON.\n"
+           "Positional snapshots (precimon -B -K) are expanded back to the full JSON too.\n"
+           "It reads the named file, or stdin when no file is given, and writes the JSON to stdout.\n\n"
+           "Example: precimon_decode myhost_20190101_1200.cbor > myhost_20190101_1200.json\n"
+           "Example: precimon -B -s 10 -c 6 | precimon_decode\n",
+        command, VERSION);
+    exit(0);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 2 || (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "-?"))))
+        hint(argv[0]);
+
+    in = stdin;
+    out = stdout;
+    if (argc == 2 && (in = fopen(argv[1], "r")) == NULL) {
+        perror(argv[1]);
+        exit(2);
+    }
+
+    decode();
+    if (output_char > 0 && fwrite(output, 1, output_char, out) != (size_t)output_char)
+        error("write failed");
+    fflush(out);
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * bench_emit.c -- the p functions against the sprintf() formats they replaced
+ * Developer: Jalal Mostafa.
+ * (C) Copyright 2019 Jalal Mostafa
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define main precimon_main
+#include "../precimon.c"
+#undef main
+
+#define BENCH_CPUS 256
+#define BENCH_DOUBLES 10
+#define BENCH_ROUNDS 5
+#define BENCH_SECTIONS 100 /* sections output per round */
+
+char* bench_double_names[BENCH_DOUBLES] = { "user", "nice", "sys", "idle", "iowait", "hardirq", "softirq", "steal", "guest", "guestnice" };
+
+struct bench_cpu {
+    char name[16];
+    double rate[BENCH_DOUBLES];
+    long long online;
+    long long unsigned mhz;
+    long long flags;
+};
+struct bench_cpu cpus[BENCH_CPUS];
+
+/* the values of a busy host, with some on the .0005 rounding edge and some negative */
+void bench_values()
+{
+    long long unsigned seed = 42;
+    int i;
+    int k;
+
+    for (i = 0; i < BENCH_CPUS; i++) {
+        snprintf(cpus[i].name, sizeof(cpus[i].name), "cpu%d", i);
+        for (k = 0; k < BENCH_DOUBLES; k++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            cpus[i].rate[k] = (seed >> 11) % 100000000 / 1e6;
+            if (k == 9)
+                cpus[i].rate[k] = i + 0.0005;
+        }
+        cpus[i].online = (i % 7 == 0) ? -i : (long long)seed >> 20;
+        cpus[i].mhz = seed;
+        cpus[i].flags = seed >> 24;
+    }
+}
+
+/* - - - the baseline: sprintf() for every value and praw() per tab - - - */
+void old_praw(char* string)
+{
+    output_char += sprintf(&output[output_char], "%s", string);
+}
+
+void old_indent()
+{
+    int i;
+
+    for (i = 0; i < saved_level; i++)
+        old_praw("\t");
+}
+
+void old_psection(char* section)
+{
+    old_indent();
+    output_char += sprintf(&output[output_char], "\"%s\": {\n", section);
+    saved_level++;
+}
+
+void old_psub(char* resource)
+{
+    old_indent();
+    output_char += sprintf(&output[output_char], "\"%s\": {\n", resource);
+    saved_level++;
+}
+
+void old_psubend()
+{
+    remove_ending_comma_if_any();
+    saved_level--;
+    old_indent();
+    old_praw("},\n");
+}
+
+void old_psectionend()
+{
+    saved_level--;
+    remove_ending_comma_if_any();
+    old_indent();
+    old_praw("},\n");
+}
+
+void old_phex(char* name, long long value)
+{
+    old_indent();
+    output_char += sprintf(&output[output_char], "\"%s\": \"0x%08llx\",\n", name, value);
+}
+
+void old_plong(char* name, long long value)
+{
+    old_indent();
+    output_char += sprintf(&output[output_char], "\"%s\": %lld,\n", name, value);
+}
+
+void old_pulong(char* name, long long unsigned value)
+{
+    old_indent();
+    output_char += sprintf(&output[output_char], "\"%s\": %llu,\n", name, value);
+}
+
+void old_pdouble(char* name, double value)
+{
+    old_indent();
+    output_char += sprintf(&output[output_char], "\"%s\": %.3f,\n", name, value);
+}
+
+/* - - - one cpus section each way - - - */
+void old_section()
+{
+    int i;
+    int k;
+
+    output_char = 0;
+    saved_level = 1;
+    old_psection("cpus");
+    for (i = 0; i < BENCH_CPUS; i++) {
+        old_psub(cpus[i].name);
+        for (k = 0; k < BENCH_DOUBLES; k++)
+            old_pdouble(bench_double_names[k], cpus[i].rate[k]);
+        old_plong("online", cpus[i].online);
+        old_pulong("mhz", cpus[i].mhz);
+        old_phex("flags", cpus[i].flags);
+        old_psubend();
+    }
+    old_psectionend();
+}
+
+void new_section()
+{
+    int i;
+    int k;
+
+    output_char = 0;
+    saved_level = 1;
+    psection("cpus");
+    for (i = 0; i < BENCH_CPUS; i++) {
+        psub(cpus[i].name);
+        for (k = 0; k < BENCH_DOUBLES; k++)
+            pdouble(bench_double_names[k], cpus[i].rate[k]);
+        plong("online", cpus[i].online);
+        pulong("mhz", cpus[i].mhz);
+        phex("flags", cpus[i].flags);
+        psubend();
+    }
+    psectionend();
+}
+
+/* the best of BENCH_ROUNDS of BENCH_SECTIONS sections in microseconds per section */
+double best(void (*section)())
+{
+    long long unsigned start;
+    double fastest = 0.0;
+    double t;
+    int i;
+    int j;
+
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        start = nanomonotime();
+        for (j = 0; j < BENCH_SECTIONS; j++)
+            section();
+        t = (nanomonotime() - start) / 1e3 / BENCH_SECTIONS;
+        if (t < fastest || i == 0)
+            fastest = t;
+    }
+    return fastest;
+}
+
+int main()
+{
+    char* expected;
+    long expected_len;
+    double before;
+    double after;
+
+    bench_values();
+    output_size = 4 * 1024 * 1024; /* the old functions do not grow the buffer */
+    output = malloc(output_size);
+
+    old_section();
+    expected = malloc(output_char + 1);
+    memcpy(expected, output, output_char + 1);
+    expected_len = output_char;
+    new_section();
+    if (output_char != expected_len || memcmp(output, expected, expected_len)) {
+        fprintf(stderr, "bench_emit: the p functions output %ld bytes that differ from the %ld of sprintf()\n", output_char, expected_len);
+        return 1;
+    }
+
+    before = best(old_section);
+    after = best(new_section);
+    printf("cpus section %d CPUs %ld bytes: sprintf %6.0fus  p functions %6.0fus  %5.1fx, same bytes\n",
+        BENCH_CPUS, expected_len, before, after, before / after);
+    return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * bench_net.c -- the netlink network collector against /proc/net/dev with 5000 interfaces
+ * Developer: Jalal Mostafa.
+ * (C) Copyright 2019 Jalal Mostafa
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define main precimon_main
+#include "../precimon.c"
+#undef main
+
+#define BENCH_INTERFACES 5000 /* made as veth pairs in a network namespace of its own, so it needs root */
+#define BENCH_ROUNDS 5
+
+/* the best of BENCH_ROUNDS samples after one to find the interfaces, and the syscalls of one */
+double bench(long* syscalls)
+{
+    long long unsigned start;
+    double fastest = 0.0;
+    double t;
+    long before;
+    int i;
+
+    proc_net_dev(PRINT_FALSE);
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        before = atomic_load(&procfile_syscalls);
+        start = nanomonotime();
+        proc_net_dev(PRINT_FALSE);
+        t = (nanomonotime() - start) / 1e3;
+        *syscalls = atomic_load(&procfile_syscalls) - before;
+        if (t < fastest || i == 0)
+            fastest = t;
+    }
+    return fastest;
+}
+
+int main()
+{
+    FILE* ip;
+    double netlink;
+    double proc;
+    long netlink_syscalls;
+    long proc_syscalls;
+    long netlink_interfaces;
+    int i;
+
+    if (unshare(CLONE_NEWNET) < 0) {
+        perror("bench_net: unshare(CLONE_NEWNET), skipped as it needs root");
+        return 0;
+    }
+    if ((ip = popen("ip -batch -", "w")) == NULL) {
+        perror("bench_net: ip -batch");
+        return 1;
+    }
+    for (i = 0; i < BENCH_INTERFACES / 2; i++)
+        fprintf(ip, "link add bench%da type veth peer name bench%db\n", i, i);
+    for (i = 0; i < BENCH_INTERFACES / 2; i++)
+        fprintf(ip, "link set bench%da up\nlink set bench%db up\n", i, i);
+    if (pclose(ip) != 0) {
+        fprintf(stderr, "bench_net: ip could not make the veth pairs, skipped\n");
+        return 0;
+    }
+    sleep(3); /* interfaces that never sent or received are left out, IPv6 sends something once they are up */
+
+    netlink = bench(&netlink_syscalls);
+    netlink_interfaces = interfaces;
+    if (net_netlink_fd < 0) {
+        fprintf(stderr, "bench_net: netlink did not work\n");
+        return 1;
+    }
+    close(net_netlink_fd);
+    net_netlink_fd = -1; /* /proc/net/dev from here */
+    proc = bench(&proc_syscalls);
+    if (interfaces != netlink_interfaces) {
+        fprintf(stderr, "bench_net: netlink found %ld interfaces, /proc/net/dev %ld\n", netlink_interfaces, interfaces);
+        return 1;
+    }
+    printf("networks %d interfaces, %ld active:  /proc/net/dev %6.0fus %4ld syscalls  netlink %6.0fus %4ld syscalls  %5.1fx\n",
+        BENCH_INTERFACES, interfaces, proc, proc_syscalls, netlink, netlink_syscalls, proc / netlink);
+    return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * bench_scan.c -- the precimon field scanner against sscanf() on a large host
+ * Developer: Jalal Mostafa.
+ * (C) Copyright 2019 Jalal Mostafa
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define main precimon_main
+#include "../precimon.c"
+#undef main
+
+#define BENCH_CPUS 4096
+#define BENCH_PROCESSES 50000
+#define BENCH_ROUNDS 5
+#define BENCH_FIELDS 39 /* PROCSINFO_FIELDS of a current kernel */
+
+/* a /proc/stat of BENCH_CPUS cpu lines, each ended by a NUL as fgets() would hand them over
+ * (sscanf() runs strlen() on its input, so one long buffer would time that instead) */
+char* bench_stat()
+{
+    char* text = malloc(BENCH_CPUS * 128 + 128);
+    long len = 0;
+    long i;
+
+    len += sprintf(&text[len], "cpu  10132153 290696 3084719 46828483 16683 0 25195 0 0 0\n") + 1;
+    for (i = 0; i < BENCH_CPUS; i++)
+        len += sprintf(&text[len], "cpu%ld %ld 2906 308471 4682848 1668 0 2519 0 0 0\n", i, 1013215 + i * 7) + 1;
+    text[len] = 0;
+    return text;
+}
+
+/* BENCH_PROCESSES /proc/<pid>/stat lines one after the other, NUL ended the same way */
+char* bench_pid_stat()
+{
+    char* text = malloc(BENCH_PROCESSES * 400L);
+    long len = 0;
+    long i;
+
+    for (i = 0; i < BENCH_PROCESSES; i++)
+        len += sprintf(&text[len], "%ld (worker-%ld) S 1 %ld %ld 0 -1 4194560 112674 7095169 69 267 500 782 45630 3449 20 0 6 0 7 "
+                                   "28749824 3390 18446744073709551615 1 1 0 0 0 0 0 4096 1088 0 0 0 17 0 0 0 0 0 0 0 0 0 0 0 0 0 0\n",
+            i + 100, i, i + 100, i + 100) + 1;
+    text[len] = 0;
+    return text;
+}
+
+double bench_stat_sscanf(char* text)
+{
+    long long unsigned start = nanomonotime();
+    long long v[10];
+    char name[64];
+    char* line;
+
+    for (line = text; *line != 0; line += strlen(line) + 1)
+        sscanf(line, "%s %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld", name,
+            &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9]);
+    return (nanomonotime() - start) / 1e3;
+}
+
+double bench_stat_scan(char* text)
+{
+    long long unsigned start = nanomonotime();
+    long long v[10];
+    char name[64];
+    char* line;
+    char* pos;
+
+    for (line = text; *line != 0; line += strlen(line) + 1) {
+        pos = line;
+        scan_word(&pos, name, sizeof(name));
+        scan_numbers(&pos, v, 10);
+    }
+    return (nanomonotime() - start) / 1e3;
+}
+
+double bench_pid_stat_sscanf(char* text)
+{
+    long long unsigned start = nanomonotime();
+    long long v[BENCH_FIELDS];
+    char comm[64];
+    char state;
+    int pid;
+    char* line;
+
+    for (line = text; *line != 0; line += strlen(line) + 1) {
+        sscanf(line, "%d (%63s)", &pid, comm);
+        /* the state and the BENCH_FIELDS numbers as the parser had them */
+        sscanf(strstr(line, ") ") + 2,
+            "%c %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld "
+            "%lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
+            &state, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9], &v[10], &v[11], &v[12],
+            &v[13], &v[14], &v[15], &v[16], &v[17], &v[18], &v[19], &v[20], &v[21], &v[22], &v[23], &v[24], &v[25],
+            &v[26], &v[27], &v[28], &v[29], &v[30], &v[31], &v[32], &v[33], &v[34], &v[35], &v[36], &v[37], &v[38]);
+    }
+    return (nanomonotime() - start) / 1e3;
+}
+
+double bench_pid_stat_scan(char* text)
+{
+    long long unsigned start = nanomonotime();
+    long long v[BENCH_FIELDS];
+    char comm[64];
+    char* line;
+    char* pos;
+
+    for (line = text; *line != 0; line += strlen(line) + 1) {
+        scan_number(line, &v[0]);
+        pos = strchr(line, '(') + 1;
+        scan_word(&pos, comm, sizeof(comm));
+        pos = strstr(line, ") ") + 3;
+        scan_numbers(&pos, v, BENCH_FIELDS);
+    }
+    return (nanomonotime() - start) / 1e3;
+}
+
+/* the best of BENCH_ROUNDS */
+double best(double (*bench)(char*), char* text)
+{
+    double fastest = 0.0;
+    double t;
+    int i;
+
+    for (i = 0; i < BENCH_ROUNDS; i++)
+        if ((t = bench(text)) < fastest || i == 0)
+            fastest = t;
+    return fastest;
+}
+
+int main()
+{
+    char* stat = bench_stat();
+    char* pid_stat = bench_pid_stat();
+    double before;
+    double after;
+
+    before = best(bench_stat_sscanf, stat);
+    after = best(bench_stat_scan, stat);
+    printf("/proc/stat %d CPUs:                sscanf %9.0fus  scanner %9.0fus  %5.1fx\n", BENCH_CPUS, before, after, before / after);
+    before = best(bench_pid_stat_sscanf, pid_stat);
+    after = best(bench_pid_stat_scan, pid_stat);
+    printf("/proc/<pid>/stat %d processes: sscanf %9.0fus  scanner %9.0fus  %5.1fx\n", BENCH_PROCESSES, before, after, before / after);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * test_aggregate.c -- the -a accumulators as network interfaces come and go
+ * Developer: Jalal Mostafa.
+ * (C) Copyright 2019 Jalal Mostafa
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* precimon is one file, so the test takes it whole with its main() renamed */
+#define main precimon_main
+#include "../precimon.c"
+#undef main
+
+struct aggregate accumulators;
+long failures = 0;
+
+/* one sample of the network collector with the interfaces given, as collector_run() does it */
+void sample(char** interfaces, double* values, int output)
+{
+    int i;
+
+    accumulators.next = 0;
+    aggregating = &accumulators;
+    aggregate_output = output;
+    saved_section = "network_interfaces";
+    for (i = 0; interfaces[i] != NULL; i++) {
+        saved_resource = interfaces[i];
+        aggregate_pdouble("ibytes", values[i]);
+    }
+    saved_section = NULL;
+    saved_resource = NULL;
+    if (aggregate_output)
+        aggregating->used = aggregating->next;
+    aggregating = NULL;
+}
+
+struct accumulator* find(char* interface)
+{
+    char key[128];
+    long i;
+
+    snprintf(key, sizeof(key), "network_interfaces/%s/ibytes", interface);
+    for (i = 0; i < accumulators.used; i++)
+        if (!strcmp(accumulators.a[i].key, key))
+            return &accumulators.a[i];
+    return NULL;
+}
+
+void expect(char* what, char* interface, long count, double min, double max)
+{
+    struct accumulator* a = find(interface);
+
+    if (a == NULL && count == 0)
+        return;
+    if (a == NULL || a->count != count || a->min != min || a->max != max) {
+        fprintf(stderr, "FAIL %s: %s count=%ld min=%.0f max=%.0f wanted count=%ld min=%.0f max=%.0f\n",
+            what, interface, a ? a->count : 0L, a ? a->min : 0.0, a ? a->max : 0.0, count, min, max);
+        failures++;
+    }
+}
+
+int main()
+{
+    char* both[] = { "eth0", "eth1", NULL };
+    char* eth1[] = { "eth1", NULL };
+    char* veth[] = { "veth0", "eth1", NULL };
+    char* reordered[] = { "eth1", "veth0", NULL };
+    double big[] = { 1000.0, 5.0 };
+    double small[] = { 1.0, 6.0 };
+
+    sample(both, big, 0);
+    sample(veth, small, 0);
+    expect("new interface in a vanished one's place", "veth0", 1, 1.0, 1.0);
+    expect("interface after it", "eth1", 2, 5.0, 6.0);
+    expect("vanished interface kept for the window", "eth0", 1, 1000.0, 1000.0);
+
+    sample(eth1, &small[1], 0);
+    sample(reordered, (double[]) { 7.0, 2.0 }, 0);
+    expect("interface moved up", "eth1", 4, 5.0, 7.0);
+    expect("interface moved down", "veth0", 2, 1.0, 2.0);
+
+    sample(both, (double[]) { 3.0, 8.0 }, 1);
+    expect("window output", "eth0", 0, 0.0, 0.0); /* reset */
+    if (accumulators.used != 2) {
+        fprintf(stderr, "FAIL window output: %ld accumulators kept, wanted 2\n", accumulators.used);
+        failures++;
+    }
+    sample(eth1, (double[]) { 9.0 }, 0);
+    sample(veth, (double[]) { 4.0, 9.0 }, 0);
+    expect("vanished interface forgotten after the window", "veth0", 1, 4.0, 4.0);
+    expect("next window", "eth1", 2, 9.0, 9.0);
+
+    printf("test_aggregate: %ld failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * test_scan.c -- the precimon field scanner against sscanf() on /proc fixtures
+ * Developer: Jalal Mostafa.
+ * (C) Copyright 2019 Jalal Mostafa
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* precimon is one file, so the test takes it whole with its main() renamed */
+#define main precimon_main
+#include "../precimon.c"
+#undef main
+
+#define TEST_FIELDS 64
+
+char* fixtures = "tests/fixtures";
+long lines = 0;
+long failures = 0;
+
+void fail(char* file, long line, char* what, char* text)
+{
+    fprintf(stderr, "FAIL %s:%ld %s: %s", file, line, what, text);
+    failures++;
+}
+
+/* up to max numbers the way the parsers used sscanf("%llu %llu ...") */
+int sscanf_numbers(char* s, long long* values, int max)
+{
+    long long unsigned value;
+    int used;
+    int i;
+
+    for (i = 0; i < max && sscanf(s, "%llu%n", &value, &used) == 1; i++) {
+        values[i] = (long long)value;
+        s += used;
+    }
+    return i;
+}
+
+/* scan_numbers() and sscanf() give the same count and values */
+void same_numbers(char* file, long line, char* text, char* s, int max)
+{
+    long long scanned[TEST_FIELDS];
+    long long expected[TEST_FIELDS];
+    int count;
+    int i;
+
+    count = sscanf_numbers(s, expected, max);
+    if (scan_numbers(&s, scanned, max) != count) {
+        fail(file, line, "number count", text);
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        if (scanned[i] != expected[i]) {
+            fail(file, line, "number value", text);
+            return;
+        }
+    }
+}
+
+/* scan_word() and sscanf("%s") give the same word */
+char* same_word(char* file, long line, char* text, char* s, int size)
+{
+    char scanned[128];
+    char expected[128];
+    char format[16];
+
+    snprintf(format, sizeof(format), "%%%ds", size - 1);
+    expected[0] = 0;
+    sscanf(s, format, expected);
+    if (!scan_word(&s, scanned, size) || strcmp(scanned, expected))
+        fail(file, line, "word", text);
+    return s;
+}
+
+FILE* fixture(char* name)
+{
+    char filename[1024];
+    FILE* fp;
+
+    snprintf(filename, sizeof(filename), "%s/%s", fixtures, name);
+    if ((fp = fopen(filename, "r")) == NULL) {
+        perror(filename);
+        exit(2);
+    }
+    return fp;
+}
+
+/* cpu  10132153 290696 3084719 46828483 16683 0 25195 0 0 0 and the counters */
+void test_stat()
+{
+    FILE* fp = fixture("proc_stat");
+    char text[8192];
+    char* s;
+    long line = 0;
+
+    while (fgets(text, sizeof(text), fp) != NULL) {
+        s = same_word("proc_stat", ++line, text, text, 64);
+        same_numbers("proc_stat", line, text, s, TEST_FIELDS);
+        lines++;
+    }
+    fclose(fp);
+}
+
+/*    8       0 sda 1918273 20122 ... the major, minor, name then up to 17 */
+void test_diskstats()
+{
+    FILE* fp = fixture("proc_diskstats");
+    long long fields[2];
+    char text[1024];
+    char* s;
+    long line = 0;
+
+    while (fgets(text, sizeof(text), fp) != NULL) {
+        s = text;
+        same_numbers("proc_diskstats", ++line, text, s, 2);
+        scan_numbers(&s, fields, 2);
+        s = same_word("proc_diskstats", line, text, s, 64);
+        same_numbers("proc_diskstats", line, text, s, 17);
+        lines++;
+    }
+    fclose(fp);
+}
+
+/* two header lines then "  name: 16 numbers" where the name may touch the colon and the first number */
+void test_net_dev()
+{
+    FILE* fp = fixture("proc_net_dev");
+    char text[1024];
+    char copy[1024];
+    char* colon;
+    long line = 0;
+
+    while (fgets(text, sizeof(text), fp) != NULL) {
+        if (++line <= 2)
+            continue;
+        strcpy(copy, text);
+        if ((colon = strchr(copy, ':')) == NULL) {
+            fail("proc_net_dev", line, "no colon", text);
+            continue;
+        }
+        *colon++ = 0;
+        same_word("proc_net_dev", line, text, copy, 128);
+        same_numbers("proc_net_dev", line, text, colon, 16);
+        lines++;
+    }
+    fclose(fp);
+}
+
+/* pid (comm) state numbers..., the comm may hold blanks and brackets */
+void test_pid_stat()
+{
+    FILE* fp = fixture("proc_pid_stat");
+    char text[2048];
+    char scanned[64];
+    char expected[64];
+    long long pid;
+    int expected_pid;
+    char* s;
+    char* end;
+    long line = 0;
+
+    while (fgets(text, sizeof(text), fp) != NULL) {
+        line++;
+        expected[0] = 0;
+        if (sscanf(text, "%d (%63s)", &expected_pid, expected) != 2
+            || scan_number(text, &pid) == NULL || pid != expected_pid) {
+            fail("proc_pid_stat", line, "pid", text);
+            continue;
+        }
+        s = strchr(text, '(') + 1;
+        if (!scan_word(&s, scanned, sizeof(scanned)) || strcmp(scanned, expected))
+            fail("proc_pid_stat", line, "comm", text);
+        if ((end = strstr(text, ") ")) == NULL) {
+            fail("proc_pid_stat", line, "end of comm", text);
+            continue;
+        }
+        same_numbers("proc_pid_stat", line, text, end + 3, PROCSINFO_FIELDS);
+        lines++;
+    }
+    fclose(fp);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+        fixtures = argv[1];
+    test_stat();
+    test_diskstats();
+    test_net_dev();
+    test_pid_stat();
+    printf("test_scan: %ld lines, %ld failures\n", lines, failures);
+    return failures != 0;
+}